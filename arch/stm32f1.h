@@ -413,6 +413,8 @@ struct Iwdg {  // [1] pp.495
 // flash memory writing and erasing
 
 struct Flash {
+    constexpr static int unit = 2;  // smallest programmable unit, in bytes
+
     constexpr static uint32_t keyr = Periph::flash + 0x04;
     constexpr static uint32_t sr   = Periph::flash + 0x0C;
     constexpr static uint32_t cr   = Periph::flash + 0x10;
@@ -432,6 +434,49 @@ struct Flash {
         write16((uint16_t const*) addr + 1, val >> 16);
     }
 
+    static void write32buf (void const* a, uint32_t const* ptr, int len) {
+        if (*(uint32_t const*) a != 0xFFFFFFFF)
+            return;
+        unlock();
+        MMIO32(cr) = 0x01;
+        for (int i = 0; i < 2*len; ++i) {
+            MMIO16((uint32_t) a + 2*i) = ((uint16_t const*) ptr)[i];
+            while (MMIO32(sr) & (1<<0)) {}
+        }
+        finish();
+    }
+
+    // program len bytes with a single unlock, the area must be erased and
+    // addr must be half-word aligned, an odd last byte is padded with 0xFF,
+    // i.e. that half-word can't be programmed again until the next erase,
+    // returns true if ok
+    static bool program (void const* addr, void const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        uint32_t a = (uint32_t) addr;
+        if (a % unit != 0)
+            return false;
+        unlock();
+        MMIO32(sr) = 0x34; // clear EOP WRPRTERR PGERR
+        MMIO32(cr) = 0x01; // PG
+        for (int i = 0; i < len; i += 2) {
+            uint8_t lo = p[i];
+            uint8_t hi = i + 1 < len ? p[i+1] : 0xFF;
+            MMIO16(a) = lo | (hi << 8);
+            a += 2;
+            while (MMIO32(sr) & (1<<0)) {}
+        }
+        bool ok = (MMIO32(sr) & 0x14) == 0;
+        finish();
+        return ok && verify(addr, buf, len);
+    }
+
+    static bool verify (void const* addr, void const* buf, int len) {
+        for (int i = 0; i < len; ++i)
+            if (((uint8_t const*) addr)[i] != ((uint8_t const*) buf)[i])
+                return false;
+        return true;
+    }
+
     static void erasePage (void const* addr) {
         unlock();
         MMIO32(cr) = 0x02;
@@ -541,18 +586,37 @@ struct ADC {
     }
 };
 
-// crc calculation
+// crc calculation unit, polynomial 0x04C11DB7, see CRC32 in jee/util-crc.h
+
+struct CrcUnit {
+    constexpr static uint32_t dr  = Periph::crc + 0x00;
+    constexpr static uint32_t cr  = Periph::crc + 0x08;
+
+    static void init () {
+        Periph::bitSet(Periph::rcc+0x14, 6); // enable CRC unit
+    }
+
+    static void reset () {
+        MMIO32(cr) = 1;  // back to 0xFFFFFFFF [1] p.64
+    }
 
-struct CRC32 {
-    static uint32_t calculate (uint32_t const* ptr, int num) {
-        Periph::bit(Periph::rcc+0x14, 6) = 1; // enable CRC unit
-        MMIO32(Periph::crc+0x08) = 1;  // reset [1] p.64
+    static uint32_t read () {
+        return MMIO32(dr);
+    }
+
+    static void feed (uint32_t val) {
+        MMIO32(dr) = val;
+    }
+
+    static void feed (uint32_t const* ptr, int num) {
         while (--num >= 0)
-            MMIO32(Periph::crc+0x00) = *ptr++;
-        return MMIO32(Periph::crc+0x00);  // calculated crc32
+            MMIO32(dr) = *ptr++;
     }
 };
 
+// CRC32 used to be defined here, keep it available to existing F1 code
+#include "../jee/util-crc.h"
+
 // can bus
 
 struct CanDev {
@@ -532,55 +532,70 @@ struct RTC {  // [1] pp.486
 // flash memory writing and erasing
 
 struct Flash {
+    constexpr static int unit = 2;  // smallest programmable unit, in bytes
+
     constexpr static uint32_t keyr = Periph::flash + 0x04;
     constexpr static uint32_t sr   = Periph::flash + 0x0C;
     constexpr static uint32_t cr   = Periph::flash + 0x10;
-
-    static void write8 (void const* addr, uint8_t val) {
-        if (*(uint8_t*) addr != 0xFF)
-            return;
-        unlock();
-        MMIO32(cr) = (0<<8) | (1<<0); // PSIZE, PG
-        MMIO8((uint32_t) addr | 0x08000000) = val;
-        finish();
-    }
+    constexpr static uint32_t ar   = Periph::flash + 0x14;
 
     static void write16 (void const* addr, uint16_t val) {
-        if (*(uint16_t*) addr != 0xFFFF)
+        if (*(uint16_t const*) addr != 0xFFFF)
             return;
         unlock();
-        MMIO32(cr) = (1<<8) | (1<<0); // PSIZE, PG
+        MMIO32(cr) = 0x01; // PG
         MMIO16((uint32_t) addr | 0x08000000) = val;
         finish();
     }
 
     static void write32 (void const* addr, uint32_t val) {
-        if (*(uint32_t*) addr != 0xFFFFFFFF)
-            return;
-        unlock();
-        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
-        MMIO32((uint32_t) addr | 0x08000000) = val;
-        finish();
+        write16(addr, val);
+        write16((uint16_t const*) addr + 1, val >> 16);
     }
 
     static void write32buf (void const* a, uint32_t const* ptr, int len) {
-        if (*(uint32_t*) a != 0xFFFFFFFF)
+        if (*(uint32_t const*) a != 0xFFFFFFFF)
             return;
+        program(a, ptr, 4*len);
+    }
+
+    // program len bytes with a single unlock, the area must be erased and
+    // addr must be half-word aligned, an odd last byte is padded with 0xFF,
+    // i.e. that half-word can't be programmed again until the next erase,
+    // returns true if ok
+    static bool program (void const* addr, void const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        uint32_t a = (uint32_t) addr | 0x08000000;
+        if (a % unit != 0)
+            return false;
         unlock();
-        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
-        for (int i = 0; i < len; ++i)
-            MMIO32(((uint32_t) a + 4*i) | 0x08000000) = ptr[i];
+        MMIO32(sr) = 0x34; // clear EOP WRPRTERR PGERR
+        MMIO32(cr) = 0x01; // PG
+        for (int i = 0; i < len; i += 2) {
+            uint8_t lo = p[i];
+            uint8_t hi = i + 1 < len ? p[i+1] : 0xFF;
+            MMIO16(a) = lo | (hi << 8);
+            a += 2;
+            while (MMIO32(sr) & (1<<0)) {}
+        }
+        bool ok = (MMIO32(sr) & 0x14) == 0;
         finish();
+        return ok && verify(addr, buf, len);
+    }
+
+    static bool verify (void const* addr, void const* buf, int len) {
+        for (int i = 0; i < len; ++i)
+            if (((uint8_t const*) addr)[i] != ((uint8_t const*) buf)[i])
+                return false;
+        return true;
     }
 
     static void erasePage (void const* addr) {
-        uint32_t a = (uint32_t) addr & 0x07FFFFFF;
-        // sectors are 16/16/16/16/64/128... KB
-        int sector = a < 0x10000 ? (a >> 14) :
-                     a < 0x20000 ? (a >> 16) + 3 :
-                                   (a >> 17) + 4;
+        // pages are 2 KB
         unlock();
-        MMIO32(cr) = (1<<16) | (2<<8) | (sector<<3) | (1<<1); // STRT PG SNB SER
+        MMIO32(cr) = 0x02; // PER
+        MMIO32(ar) = (uint32_t) addr | 0x08000000;
+        MMIO32(cr) = 0x42; // STRT PER
         finish();
     }
 
@@ -590,8 +605,36 @@ struct Flash {
     }
 
     static void finish () {
-        while (Periph::bit(sr, 16)) {}
-        MMIO32(cr) = (1<<31); // LOCK
+        while (MMIO32(sr) & (1<<0)) {}
+        MMIO32(cr) = 0x80; // LOCK
+    }
+};
+
+// crc calculation unit, polynomial 0x04C11DB7, see CRC32 in jee/util-crc.h
+
+struct CrcUnit {
+    constexpr static uint32_t dr  = Periph::crc + 0x00;
+    constexpr static uint32_t cr  = Periph::crc + 0x08;
+
+    static void init () {
+        Periph::bitSet(Periph::rcc+0x14, 6); // enable CRC unit
+    }
+
+    static void reset () {
+        MMIO32(cr) = 1;  // back to 0xFFFFFFFF
+    }
+
+    static uint32_t read () {
+        return MMIO32(dr);
+    }
+
+    static void feed (uint32_t val) {
+        MMIO32(dr) = val;
+    }
+
+    static void feed (uint32_t const* ptr, int num) {
+        while (--num >= 0)
+            MMIO32(dr) = *ptr++;
     }
 };
 
@@ -534,6 +534,8 @@ struct RTC {  // [1] pp.486
 // flash memory writing and erasing
 
 struct Flash {
+    constexpr static int unit = 1;  // smallest programmable unit, in bytes
+
     constexpr static uint32_t keyr = Periph::flash + 0x04;
     constexpr static uint32_t sr   = Periph::flash + 0x0C;
     constexpr static uint32_t cr   = Periph::flash + 0x10;
@@ -575,6 +577,38 @@ struct Flash {
         finish();
     }
 
+    // program len bytes with a single unlock, the area must be erased, uses
+    // 32-bit writes (x64 would need an external Vpp), returns true if ok
+    static bool program (void const* addr, void const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        uint32_t a = (uint32_t) addr | 0x08000000;
+        unlock();
+        MMIO32(sr) = 0xF3; // clear EOP OPERR and error flags
+        MMIO32(cr) = (0<<8) | (1<<0); // PSIZE, PG
+        int i = 0;
+        for (; i < len && ((a + i) & 3) != 0; ++i)
+            MMIO8(a + i) = p[i];
+        while (Periph::bit(sr, 16)) {}
+        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
+        for (; i + 4 <= len; i += 4)
+            MMIO32(a + i) = p[i] | (p[i+1]<<8) | (p[i+2]<<16) | (p[i+3]<<24);
+        while (Periph::bit(sr, 16)) {}
+        MMIO32(cr) = (0<<8) | (1<<0); // PSIZE, PG
+        for (; i < len; ++i)
+            MMIO8(a + i) = p[i];
+        while (Periph::bit(sr, 16)) {}
+        bool ok = (MMIO32(sr) & 0xF2) == 0;
+        finish();
+        return ok && verify(addr, buf, len);
+    }
+
+    static bool verify (void const* addr, void const* buf, int len) {
+        for (int i = 0; i < len; ++i)
+            if (((uint8_t const*) addr)[i] != ((uint8_t const*) buf)[i])
+                return false;
+        return true;
+    }
+
     static void erasePage (void const* addr) {
         uint32_t a = (uint32_t) addr & 0x07FFFFFF;
         // sectors are 16/16/16/16/64/128... KB
@@ -13,6 +13,7 @@ namespace Periph {
     constexpr uint32_t rcc   = 0x40023800;
     constexpr uint32_t flash = 0x40023C00;
     constexpr uint32_t fmc   = 0xA0000000;
+    constexpr uint32_t qspi  = 0xA0001000;
     constexpr uint32_t dwt   = 0xE0001000;
 
     inline uint32_t bit (uint32_t a, int b) { return (MMIO32(a) >> b) & 1; }
@@ -479,6 +480,8 @@ struct RTC {  // [1] pp.486
 // flash memory writing and erasing
 
 struct Flash {
+    constexpr static int unit = 1;  // smallest programmable unit, in bytes
+
     constexpr static uint32_t keyr = Periph::flash + 0x04;
     constexpr static uint32_t sr   = Periph::flash + 0x0C;
     constexpr static uint32_t cr   = Periph::flash + 0x10;
@@ -520,6 +523,38 @@ struct Flash {
         finish();
     }
 
+    // program len bytes with a single unlock, the area must be erased, uses
+    // 32-bit writes (x64 would need an external Vpp), returns true if ok
+    static bool program (void const* addr, void const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        uint32_t a = (uint32_t) addr | 0x08000000;
+        unlock();
+        MMIO32(sr) = 0xF3; // clear EOP OPERR and error flags
+        MMIO32(cr) = (0<<8) | (1<<0); // PSIZE, PG
+        int i = 0;
+        for (; i < len && ((a + i) & 3) != 0; ++i)
+            MMIO8(a + i) = p[i];
+        while (Periph::bit(sr, 16)) {}
+        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
+        for (; i + 4 <= len; i += 4)
+            MMIO32(a + i) = p[i] | (p[i+1]<<8) | (p[i+2]<<16) | (p[i+3]<<24);
+        while (Periph::bit(sr, 16)) {}
+        MMIO32(cr) = (0<<8) | (1<<0); // PSIZE, PG
+        for (; i < len; ++i)
+            MMIO8(a + i) = p[i];
+        while (Periph::bit(sr, 16)) {}
+        bool ok = (MMIO32(sr) & 0xF2) == 0;
+        finish();
+        return ok && verify(addr, buf, len);
+    }
+
+    static bool verify (void const* addr, void const* buf, int len) {
+        for (int i = 0; i < len; ++i)
+            if (((uint8_t const*) addr)[i] != ((uint8_t const*) buf)[i])
+                return false;
+        return true;
+    }
+
     static void erasePage (void const* addr) {
         uint32_t a = (uint32_t) addr & 0x07FFFFFF;
         // sectors are 16/16/16/16/64/128... KB
@@ -542,6 +577,149 @@ struct Flash {
     }
 };
 
+// quad spi flash, indirect mode and memory-mapped at 0x90000000
+// the CLK, NCS, and IO0..3 pins must be set to their alternate function
+// beforehand, as this depends on the board (e.g. AF9/AF10 for F746 Disco)
+// DCYC is the number of dummy cycles after the mode byte in quad i/o reads
+
+template< int DCYC =4 >
+struct QuadSpi {
+    constexpr static uint32_t cr    = Periph::qspi + 0x00;
+    constexpr static uint32_t dcr   = Periph::qspi + 0x04;
+    constexpr static uint32_t sr    = Periph::qspi + 0x08;
+    constexpr static uint32_t fcr   = Periph::qspi + 0x0C;
+    constexpr static uint32_t dlr   = Periph::qspi + 0x10;
+    constexpr static uint32_t ccr   = Periph::qspi + 0x14;
+    constexpr static uint32_t ar    = Periph::qspi + 0x18;
+    constexpr static uint32_t abr   = Periph::qspi + 0x1C;
+    constexpr static uint32_t dr    = Periph::qspi + 0x20;
+    constexpr static uint32_t psmkr = Periph::qspi + 0x24;
+    constexpr static uint32_t psmar = Periph::qspi + 0x28;
+    constexpr static uint32_t pir   = Periph::qspi + 0x2C;
+
+    constexpr static uint32_t mem   = 0x90000000;
+
+    // size is log2 of the flash size in bytes, the clock is AHB / div
+    static void init (int size, int div =2) {
+        Periph::bitSet(Periph::rcc+0x38, 1); // QSPIEN
+        MMIO32(cr) = 0;
+        MMIO32(dcr) = ((size-1)<<16) | (2<<8); // FSIZE, CSHT
+        MMIO32(abr) = 0xFF; // mode byte, no continuous read
+        MMIO32(cr) = ((div-1)<<24) | (1<<4) | (1<<0); // PRESCALER SSHIFT EN
+    }
+
+    // W25Qxx only: set the QE bit in status register 2
+    static void quadEnable () {
+        int sr2 = readReg(0x35);
+        if ((sr2 & 0x02) == 0)
+            writeReg(0x31, sr2 | 0x02);
+    }
+
+    static void command (int op) {
+        start(0, op, 0, 0);
+        done();
+    }
+
+    static int readReg (int op) {
+        start(1, op, 0, 1, 0, 0, 1);
+        while (!Periph::bit(sr, 2)) {} // FTF
+        int v = MMIO8(dr);
+        done();
+        return v;
+    }
+
+    static void writeReg (int op, int val) {
+        command(0x06);
+        start(0, op, 0, 1, 0, 0, 1);
+        MMIO8(dr) = val;
+        done();
+        wait();
+    }
+
+    // quad i/o fast read, i.e. 1-4-4 with a mode byte and dummy cycles
+    static void read (uint32_t addr, void* buf, int cnt) {
+        if (cnt <= 0)
+            return;
+        start(1, wide() ? 0xEC : 0xEB, 3, 3, DCYC, 3, cnt);
+        MMIO32(ar) = addr;
+        for (int i = 0; i < cnt; ++i) {
+            while (!Periph::bit(sr, 2)) {} // FTF
+            ((uint8_t*) buf)[i] = MMIO8(dr);
+        }
+        done();
+    }
+
+    // quad page program, 1-1-4, split up so each stays within one page
+    static void write (uint32_t addr, void const* buf, int cnt) {
+        auto p = (uint8_t const*) buf;
+        while (cnt > 0) {
+            int n = 256 - (addr & 0xFF);
+            if (n > cnt)
+                n = cnt;
+            command(0x06);
+            start(0, wide() ? 0x34 : 0x32, 1, 3, 0, 0, n);
+            MMIO32(ar) = addr;
+            for (int i = 0; i < n; ++i) {
+                while (!Periph::bit(sr, 2)) {} // FTF
+                MMIO8(dr) = p[i];
+            }
+            done();
+            wait();
+            addr += n;
+            p += n;
+            cnt -= n;
+        }
+    }
+
+    // erase the 4 KB sector containing addr
+    static void erase (uint32_t addr) {
+        command(0x06);
+        start(0, wide() ? 0x21 : 0x20, 1, 0);
+        MMIO32(ar) = addr;
+        done();
+        wait();
+    }
+
+    // after this, the flash can be read directly at "mem", any of the above
+    // calls will abort memory-mapped mode again
+    static void map () {
+        start(3, wide() ? 0xEC : 0xEB, 3, 3, DCYC, 3);
+    }
+
+    // let the controller poll the status register until WIP is clear
+    static void wait () {
+        MMIO32(psmkr) = 0x01;
+        MMIO32(psmar) = 0x00;
+        MMIO32(pir) = 0x10;
+        Periph::bitSet(cr, 22); // APMS
+        start(2, 0x05, 0, 1, 0, 0, 1);
+        while (!Periph::bit(sr, 3)) {} // SMF
+        MMIO32(fcr) = (1<<3); // CSMF
+    }
+
+    // chips over 16 MB use the 4-byte address commands
+    static bool wide () {
+        return ((MMIO32(dcr) >> 16) & 0x1F) >= 24;
+    }
+
+    // fmode: 0 = write, 1 = read, 2 = auto-poll, 3 = memory-mapped
+    static void start (int fmode, int op, int admode, int dmode,
+                        int dcyc =0, int abmode =0, int len =0) {
+        if (((MMIO32(ccr) >> 26) & 3) == 3)
+            Periph::bitSet(cr, 1); // ABORT
+        while (Periph::bit(sr, 5)) {} // BUSY
+        if (len > 0)
+            MMIO32(dlr) = len - 1;
+        MMIO32(ccr) = (fmode<<26) | (dmode<<24) | (dcyc<<18) | (abmode<<14) |
+                        ((wide() ? 3 : 2)<<12) | (admode<<10) | (1<<8) | op;
+    }
+
+    static void done () {
+        while (!Periph::bit(sr, 1)) {} // TCF
+        MMIO32(fcr) = (1<<1); // CTCF
+    }
+};
+
 // timers and PWM
 
 template< int N >
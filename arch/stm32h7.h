@@ -8,6 +8,7 @@
 namespace Periph {
     constexpr uint32_t flash = 0x52002000;
     constexpr uint32_t fmc   = 0x52004000;
+    constexpr uint32_t qspi  = 0x52005000;
     constexpr uint32_t rtc   = 0x58004000;
     constexpr uint32_t iwdg  = 0x58004800;
     constexpr uint32_t gpio  = 0x58020000;
@@ -479,66 +480,219 @@ struct RTC {  // [1] pp.486
 // flash memory writing and erasing
 
 struct Flash {
+    constexpr static int unit = 32;  // smallest programmable unit, in bytes
+
+    // bank 2 has the same registers, at +0x100
     constexpr static uint32_t keyr = Periph::flash + 0x04;
-    constexpr static uint32_t sr   = Periph::flash + 0x0C;
-    constexpr static uint32_t cr   = Periph::flash + 0x10;
+    constexpr static uint32_t cr   = Periph::flash + 0x0C;
+    constexpr static uint32_t sr   = Periph::flash + 0x10;
+    constexpr static uint32_t ccr  = Periph::flash + 0x14;
+
+    static uint32_t bank (uint32_t a) {
+        return (a & 0x07FFFFFF) >= 0x100000 ? 0x100 : 0;
+    }
+
+    // program len bytes with a single unlock, the area must be erased and
+    // addr must be aligned to a 256-bit flash word, a partial last word is
+    // padded with 0xFF, i.e. it can't be programmed again until the next
+    // erase, writes may not cross banks, returns true if ok
+    static bool program (void const* addr, void const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        uint32_t a = (uint32_t) addr | 0x08000000;
+        if (a % unit != 0)
+            return false;
+        uint32_t b = bank(a);
+        unlock(b);
+        MMIO32(ccr + b) = 0x07EF0000; // clear EOP and error flags
+        MMIO32(cr + b) = (3<<4) | (1<<1); // PSIZE, PG
+        for (int i = 0; i < len; i += 32) {
+            for (int j = 0; j < 32; j += 4) {
+                uint32_t w = 0;
+                for (int k = 3; k >= 0; --k) {
+                    int n = i + j + k;
+                    w = (w << 8) | (n < len ? p[n] : 0xFF);
+                }
+                MMIO32(a + j) = w;
+            }
+            a += 32;
+            while (MMIO32(sr + b) & (1<<2)) {} // QW
+        }
+        bool ok = (MMIO32(sr + b) & 0x07EE0000) == 0;
+        finish(b);
+        return ok && verify(addr, buf, len);
+    }
 
-    static void write8 (void const* addr, uint8_t val) {
-        if (*(uint8_t*) addr != 0xFF)
-            return;
-        unlock();
-        MMIO32(cr) = (0<<8) | (1<<0); // PSIZE, PG
-        MMIO8((uint32_t) addr | 0x08000000) = val;
-        finish();
+    static bool verify (void const* addr, void const* buf, int len) {
+        for (int i = 0; i < len; ++i)
+            if (((uint8_t const*) addr)[i] != ((uint8_t const*) buf)[i])
+                return false;
+        return true;
     }
 
-    static void write16 (void const* addr, uint16_t val) {
-        if (*(uint16_t*) addr != 0xFFFF)
-            return;
-        unlock();
-        MMIO32(cr) = (1<<8) | (1<<0); // PSIZE, PG
-        MMIO16((uint32_t) addr | 0x08000000) = val;
-        finish();
+    static void erasePage (void const* addr) {
+        uint32_t a = (uint32_t) addr & 0x07FFFFFF;
+        // sectors are 128 KB
+        int sector = (a >> 17) & 7;
+        uint32_t b = bank(a);
+        unlock(b);
+        MMIO32(cr + b) = (sector<<8) | (3<<4) | (1<<2); // SNB PSIZE SER
+        Periph::bitSet(cr + b, 7); // START
+        finish(b);
+    }
+
+    static void unlock (uint32_t b =0) {
+        if (Periph::bit(cr + b, 0)) {
+            MMIO32(keyr + b) = 0x45670123;
+            MMIO32(keyr + b) = 0xCDEF89AB;
+        }
     }
 
-    static void write32 (void const* addr, uint32_t val) {
-        if (*(uint32_t*) addr != 0xFFFFFFFF)
-            return;
-        unlock();
-        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
-        MMIO32((uint32_t) addr | 0x08000000) = val;
-        finish();
+    static void finish (uint32_t b =0) {
+        while (MMIO32(sr + b) & ((1<<2) | (1<<0))) {} // QW BSY
+        MMIO32(cr + b) = 1<<0; // LOCK
     }
+};
 
-    static void write32buf (void const* a, uint32_t const* ptr, int len) {
-        if (*(uint32_t*) a != 0xFFFFFFFF)
+// quad spi flash, indirect mode and memory-mapped at 0x90000000
+// the CLK, NCS, and IO0..3 pins must be set to their alternate function
+// beforehand, as this depends on the board
+// DCYC is the number of dummy cycles after the mode byte in quad i/o reads
+
+template< int DCYC =4 >
+struct QuadSpi {
+    constexpr static uint32_t cr    = Periph::qspi + 0x00;
+    constexpr static uint32_t dcr   = Periph::qspi + 0x04;
+    constexpr static uint32_t sr    = Periph::qspi + 0x08;
+    constexpr static uint32_t fcr   = Periph::qspi + 0x0C;
+    constexpr static uint32_t dlr   = Periph::qspi + 0x10;
+    constexpr static uint32_t ccr   = Periph::qspi + 0x14;
+    constexpr static uint32_t ar    = Periph::qspi + 0x18;
+    constexpr static uint32_t abr   = Periph::qspi + 0x1C;
+    constexpr static uint32_t dr    = Periph::qspi + 0x20;
+    constexpr static uint32_t psmkr = Periph::qspi + 0x24;
+    constexpr static uint32_t psmar = Periph::qspi + 0x28;
+    constexpr static uint32_t pir   = Periph::qspi + 0x2C;
+
+    constexpr static uint32_t mem   = 0x90000000;
+
+    // size is log2 of the flash size in bytes, the clock is AHB / div
+    static void init (int size, int div =2) {
+        Periph::bitSet(Periph::rcc+0xD4, 14); // QSPIEN
+        MMIO32(cr) = 0;
+        MMIO32(dcr) = ((size-1)<<16) | (2<<8); // FSIZE, CSHT
+        MMIO32(abr) = 0xFF; // mode byte, no continuous read
+        MMIO32(cr) = ((div-1)<<24) | (1<<4) | (1<<0); // PRESCALER SSHIFT EN
+    }
+
+    // W25Qxx only: set the QE bit in status register 2
+    static void quadEnable () {
+        int sr2 = readReg(0x35);
+        if ((sr2 & 0x02) == 0)
+            writeReg(0x31, sr2 | 0x02);
+    }
+
+    static void command (int op) {
+        start(0, op, 0, 0);
+        done();
+    }
+
+    static int readReg (int op) {
+        start(1, op, 0, 1, 0, 0, 1);
+        while (!Periph::bit(sr, 2)) {} // FTF
+        int v = MMIO8(dr);
+        done();
+        return v;
+    }
+
+    static void writeReg (int op, int val) {
+        command(0x06);
+        start(0, op, 0, 1, 0, 0, 1);
+        MMIO8(dr) = val;
+        done();
+        wait();
+    }
+
+    // quad i/o fast read, i.e. 1-4-4 with a mode byte and dummy cycles
+    static void read (uint32_t addr, void* buf, int cnt) {
+        if (cnt <= 0)
             return;
-        unlock();
-        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
-        for (int i = 0; i < len; ++i)
-            MMIO32(((uint32_t) a + 4*i) | 0x08000000) = ptr[i];
-        finish();
+        start(1, wide() ? 0xEC : 0xEB, 3, 3, DCYC, 3, cnt);
+        MMIO32(ar) = addr;
+        for (int i = 0; i < cnt; ++i) {
+            while (!Periph::bit(sr, 2)) {} // FTF
+            ((uint8_t*) buf)[i] = MMIO8(dr);
+        }
+        done();
+    }
+
+    // quad page program, 1-1-4, split up so each stays within one page
+    static void write (uint32_t addr, void const* buf, int cnt) {
+        auto p = (uint8_t const*) buf;
+        while (cnt > 0) {
+            int n = 256 - (addr & 0xFF);
+            if (n > cnt)
+                n = cnt;
+            command(0x06);
+            start(0, wide() ? 0x34 : 0x32, 1, 3, 0, 0, n);
+            MMIO32(ar) = addr;
+            for (int i = 0; i < n; ++i) {
+                while (!Periph::bit(sr, 2)) {} // FTF
+                MMIO8(dr) = p[i];
+            }
+            done();
+            wait();
+            addr += n;
+            p += n;
+            cnt -= n;
+        }
     }
 
-    static void erasePage (void const* addr) {
-        uint32_t a = (uint32_t) addr & 0x07FFFFFF;
-        // sectors are 16/16/16/16/64/128... KB
-        int sector = a < 0x10000 ? (a >> 14) :
-                     a < 0x20000 ? (a >> 16) + 3 :
-                                   (a >> 17) + 4;
-        unlock();
-        MMIO32(cr) = (1<<16) | (2<<8) | (sector<<3) | (1<<1); // STRT PG SNB SER
-        finish();
+    // erase the 4 KB sector containing addr
+    static void erase (uint32_t addr) {
+        command(0x06);
+        start(0, wide() ? 0x21 : 0x20, 1, 0);
+        MMIO32(ar) = addr;
+        done();
+        wait();
+    }
+
+    // after this, the flash can be read directly at "mem", any of the above
+    // calls will abort memory-mapped mode again
+    static void map () {
+        start(3, wide() ? 0xEC : 0xEB, 3, 3, DCYC, 3);
+    }
+
+    // let the controller poll the status register until WIP is clear
+    static void wait () {
+        MMIO32(psmkr) = 0x01;
+        MMIO32(psmar) = 0x00;
+        MMIO32(pir) = 0x10;
+        Periph::bitSet(cr, 22); // APMS
+        start(2, 0x05, 0, 1, 0, 0, 1);
+        while (!Periph::bit(sr, 3)) {} // SMF
+        MMIO32(fcr) = (1<<3); // CSMF
+    }
+
+    // chips over 16 MB use the 4-byte address commands
+    static bool wide () {
+        return ((MMIO32(dcr) >> 16) & 0x1F) >= 24;
     }
 
-    static void unlock () {
-        MMIO32(keyr) = 0x45670123;
-        MMIO32(keyr) = 0xCDEF89AB;
+    // fmode: 0 = write, 1 = read, 2 = auto-poll, 3 = memory-mapped
+    static void start (int fmode, int op, int admode, int dmode,
+                        int dcyc =0, int abmode =0, int len =0) {
+        if (((MMIO32(ccr) >> 26) & 3) == 3)
+            Periph::bitSet(cr, 1); // ABORT
+        while (Periph::bit(sr, 5)) {} // BUSY
+        if (len > 0)
+            MMIO32(dlr) = len - 1;
+        MMIO32(ccr) = (fmode<<26) | (dmode<<24) | (dcyc<<18) | (abmode<<14) |
+                        ((wide() ? 3 : 2)<<12) | (admode<<10) | (1<<8) | op;
     }
 
-    static void finish () {
-        while (Periph::bit(sr, 16)) {}
-        MMIO32(cr) = (1<<31); // LOCK
+    static void done () {
+        while (!Periph::bit(sr, 1)) {} // TCF
+        MMIO32(fcr) = (1<<1); // CTCF
     }
 };
 
@@ -392,6 +392,8 @@ struct Iwdg {  // [1] pp.495
 // flash memory writing and erasing
 
 struct Flash {
+    constexpr static int unit = 8;  // smallest programmable unit, in bytes
+
     constexpr static uint32_t keyr = Periph::flash + 0x08;
     constexpr static uint32_t sr   = Periph::flash + 0x10;
     constexpr static uint32_t cr   = Periph::flash + 0x14;
@@ -406,17 +408,55 @@ struct Flash {
         wait();
     }
 
-#if 0 // incorrect
+    // len must be even, as flash is programmed in 64-bit double-words
     static void write32buf (void const* a, uint32_t const* ptr, int len) {
         if (*(uint32_t*) a != 0xFFFFFFFF)
             return;
         unlock();
-        MMIO32(cr) = (2<<8) | (1<<0); // PSIZE, PG
-        for (int i = 0; i < len; ++i)
+        Periph::bitSet(cr, 0); // PG
+        for (int i = 0; i < len; i += 2) {
             MMIO32(((uint32_t) a + 4*i) | 0x08000000) = ptr[i];
-        wait();
+            MMIO32(((uint32_t) a + 4*i + 4) | 0x08000000) = ptr[i+1];
+            wait();
+        }
+        finish();
+    }
+
+    // program len bytes with a single unlock, the area must be erased and
+    // addr must be double-word aligned, a partial last double-word is padded
+    // with 0xFF, i.e. it can't be programmed again until the next erase,
+    // returns true if ok
+    static bool program (void const* addr, void const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        uint32_t a = (uint32_t) addr | 0x08000000;
+        if (a % unit != 0)
+            return false;
+        unlock();
+        MMIO32(sr) = 0x3FB; // clear EOP and error flags
+        Periph::bitSet(cr, 0); // PG
+        for (int i = 0; i < len; i += 8) {
+            for (int j = 0; j < 8; j += 4) {
+                uint32_t w = 0;
+                for (int k = 3; k >= 0; --k) {
+                    int n = i + j + k;
+                    w = (w << 8) | (n < len ? p[n] : 0xFF);
+                }
+                MMIO32(a + j) = w;
+            }
+            a += 8;
+            wait();
+        }
+        bool ok = (MMIO32(sr) & 0x3FA) == 0;
+        finish();
+        return ok && verify(addr, buf, len);
+    }
+
+    static bool verify (void const* addr, void const* buf, int len) {
+        for (int i = 0; i < len; ++i)
+            if (((uint8_t const*) addr)[i] != ((uint8_t const*) buf)[i])
+                return false;
+        return true;
     }
-#endif
 
     static void erasePage (void const* addr) {
         uint32_t a = (uint32_t) addr & 0x07FFFFFF;
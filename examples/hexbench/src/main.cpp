@@ -0,0 +1,158 @@
+// Benchmark of the Intel hex parser in text-ihex.h on the host. A random
+// image gets converted to hex text in memory, which is then parsed back,
+// once a character at a time and once with the buffer parse. The decoded
+// data is checked against the image after each run.
+// Build with: g++ -std=c++11 -O2 -I../.. src/main.cpp -o hexbench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <jee/text-ihex.h>
+
+const uint32_t BASE = 0x08000000;
+
+uint8_t* image;     // the original data
+uint8_t* result;    // the data as decoded from the hex text
+char* text;         // the hex text
+int size, length, records;
+
+char* putByte (char* p, uint8_t b, uint8_t& sum) {
+    static char const hex [] = "0123456789ABCDEF";
+    *p++ = hex[b>>4];
+    *p++ = hex[b&0xF];
+    sum += b;
+    return p;
+}
+
+char* putRecord (char* p, int type, uint16_t addr, uint8_t const* buf, int n) {
+    uint8_t sum = 0;
+    *p++ = ':';
+    p = putByte(p, n, sum);
+    p = putByte(p, addr >> 8, sum);
+    p = putByte(p, addr, sum);
+    p = putByte(p, type, sum);
+    for (int i = 0; i < n; ++i)
+        p = putByte(p, buf[i], sum);
+    p = putByte(p, -sum, sum);
+    *p++ = '\r';
+    *p++ = '\n';
+    ++records;
+    return p;
+}
+
+// random data in records of "reclen" bytes, with a type 04 record for
+// each 64 KB, and a start address and end-of-file record at the end
+void generate (int reclen) {
+    image = (uint8_t*) malloc(size);
+    result = (uint8_t*) malloc(size);
+    text = (char*) malloc(size / reclen * (2 * reclen + 13) + 1000);
+
+    uint32_t seed = 1;
+    for (int i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = seed >> 16;
+    }
+
+    char* p = text;
+    for (int pos = 0; pos < size; pos += reclen) {
+        uint32_t addr = BASE + pos;
+        if (pos == 0 || (addr & 0xFFFF) < (uint32_t) reclen) {
+            uint8_t upper [2] = { (uint8_t) (addr >> 24), (uint8_t) (addr >> 16) };
+            p = putRecord(p, 4, 0, upper, 2);
+        }
+        int n = size - pos < reclen ? size - pos : reclen;
+        p = putRecord(p, 0, addr, image + pos, n);
+    }
+    uint8_t start [4];
+    for (int i = 0; i < 4; ++i)
+        start[i] = BASE >> (24 - 8 * i);
+    p = putRecord(p, 5, 0, start, 4);
+    p = putRecord(p, 1, 0, 0, 0);
+    length = p - text;
+}
+
+IntelHex<64> hex;
+int decoded, errors;
+
+// handle a completed record
+void apply () {
+    ++decoded;
+    if (hex.check != 0)
+        ++errors;
+    else if (hex.type == 0) {
+        uint32_t off = hex.address() - BASE;
+        if (off + hex.len <= (uint32_t) size)
+            memcpy(result + off, hex.data, hex.len);
+        else
+            ++errors;
+    }
+}
+
+// as in examples/ihex.cpp: wait for a ':', then parse until done
+void perChar () {
+    bool busy = false;
+    for (int i = 0; i < length; ++i)
+        if (!busy) {
+            if (text[i] == ':') {
+                hex.init();
+                busy = true;
+            }
+        } else if (hex.parse(text[i])) {
+            apply();
+            busy = false;
+        }
+}
+
+void buffered () {
+    char const* p = text;
+    int n = length;
+    while (n > 0) {
+        int k = hex.parse(p, n);
+        if (hex.ready())
+            apply();
+        p += k;
+        n -= k;
+    }
+}
+
+// best of several runs, returns MB/s of hex text
+double run (char const* label, void (*fun)(), int runs) {
+    double best = 1e9;
+    for (int r = 0; r < runs; ++r) {
+        memset(result, 0, size);
+        hex.reset();
+        decoded = errors = 0;
+        clock_t start = clock();
+        fun();
+        double t = (double) (clock() - start) / CLOCKS_PER_SEC;
+        if (t < best)
+            best = t;
+    }
+    bool ok = decoded == records && errors == 0 &&
+                memcmp(result, image, size) == 0 && hex.entry == BASE;
+    double rate = length / best / 1e6;
+    printf("  %-10s %7.1f ms %7.1f MB/s  %s\n",
+            label, best * 1e3, rate, ok ? "ok" : "FAILED");
+    return ok ? rate : 0;
+}
+
+int main (int argc, char const** argv) {
+    size = (argc > 1 ? atoi(argv[1]) : 4096) * 1024;
+    int reclen = argc > 2 ? atoi(argv[2]) : 32;
+    int runs = argc > 3 ? atoi(argv[3]) : 10;
+    if (size <= 0 || reclen <= 0 || reclen > 64 || runs <= 0) {
+        printf("usage: hexbench [kb [reclen [runs]]]\n");
+        return 2;
+    }
+
+    generate(reclen);
+    printf("%d KB image, %d-byte records: %d records, %.1f MB of hex text\n",
+            size / 1024, reclen, records, length / 1e6);
+    printf("best of %d runs:\n", runs);
+
+    double a = run("per char", perChar, runs);
+    double b = run("buffer", buffered, runs);
+    return a > 0 && b > 0 ? 0 : 1;
+}
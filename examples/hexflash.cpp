@@ -0,0 +1,37 @@
+// Receive Intel hex text over serial and write it to flash, above 16 KB.
+
+#include <jee.h>
+#include <jee/text-ihex.h>
+
+UartBufDev< PinA<9>, PinA<10>, 25, 250 > console;
+
+int printf(const char* fmt, ...) {
+    va_list ap; va_start(ap, fmt); veprintf(console.putc, fmt, ap); va_end(ap);
+    return 0;
+}
+
+// 64 KB of flash, programmed 1 KB at a time, with 1 KB erase pages
+HexFlasher< Flash, 0x10000 > flasher;
+
+int main () {
+    console.init();
+    console.baud(115200, fullSpeedClock());
+    printf("send hex now\n");
+
+    flasher.init(0x4000);
+
+    while (!flasher.done) {
+        if (console.readable()) {
+            int c = console.getc();
+            if (!flasher.feed(c))
+                break;
+            if (c == '\n')
+                console.putc('.');  // ack each line, for flow control
+        } else
+            flasher.poll();
+    }
+
+    bool ok = flasher.finish();
+    printf("\n%s, entry $%08x\n", ok ? "ok" : "FAILED", flasher.hex.entry);
+    return 0;
+}
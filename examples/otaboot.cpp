@@ -0,0 +1,28 @@
+// Boot loader for over-the-air updates, see jee/util-ota.h: installs a new
+// image from SpiFlash if one is pending, then starts the application, which
+// must be linked to run at 0x08002000, right above this code.
+
+#include <jee.h>
+#include <jee/spi-flash.h>
+#include <jee/util-ota.h>
+
+SpiGpio< PinB<15>, PinB<14>, PinB<13>, PinB<12> > spi2;
+SpiFlash< decltype(spi2) > mem;
+
+constexpr uint32_t APP = 0x2000, SIZE = 0xE000;  // 8 .. 64 KB
+
+typedef OtaFlash< Flash, APP, 1024 > AppArea;
+typedef OtaSpiFlash< decltype(mem), 0 > StageArea;
+OtaStage< AppArea, StageArea, SIZE > ota;
+
+int main () {
+    spi2.init();
+    mem.init();
+    ota.install();
+
+    // start the application: set its vector table, stack, and reset handler
+    uint32_t const* vtab = (uint32_t const*) (0x08000000 + APP);
+    MMIO32(0xE000ED08) = (uint32_t) vtab;  // SCB VTOR
+    __asm("msr msp, %0\n bx %1" :: "r" (vtab[0]), "r" (vtab[1]));
+    while (true) {}
+}
@@ -0,0 +1,65 @@
+// Show incoming wireless RF69 packets on USART1, using the DIO0 interrupt.
+// Also sends out a packet every 5 seconds, without blocking reception.
+
+#include <jee.h>
+#include <jee/spi-rf69.h>
+
+UartBufDev< PinA<9>, PinA<10> > console;
+
+int printf(const char* fmt, ...) {
+    va_list ap; va_start(ap, fmt); veprintf(console.putc, fmt, ap); va_end(ap);
+    return 0;
+}
+
+SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinA<4> > spi;  // default SPI1 pins
+RF69Irq< decltype(spi) > rf;
+
+PinB<0> dio0;  // on EXTI line 0
+PinC<13> led;
+
+int main () {
+    enableSysTick();
+    led.mode(Pinmode::out);
+    dio0.mode(Pinmode::in_float);
+    spi.init();
+    rf.init(63, 42, 8683);  // node 63, group 42, 868.3 MHz
+    rf.listen();
+
+    VTableRam().exti0 = []() {
+        MMIO32(Periph::exti+0x14) = 1<<0;  // clear pending bit in PR
+        rf.interrupt();
+    };
+
+    MMIO32(Periph::afio+0x08) = 1<<0;    // EXTICR1: line 0 is port B
+    MMIO32(Periph::exti+0x08) |= 1<<0;   // RTSR: trigger on rising edge
+    MMIO32(Periph::exti+0x00) |= 1<<0;   // IMR: unmask line 0
+    MMIO32(0xE000E100) = 1<<6;           // NVIC: enable EXTI0 interrupt
+
+    uint32_t lastSend = 0;
+    uint8_t count = 0;
+
+    while (true) {
+        if (ticks - lastSend >= 5000) {
+            lastSend = ticks;
+            ++count;
+            if (!rf.send(0, &count, sizeof count))
+                printf("tx queue full\n");
+
+            auto& s = rf.stats;
+            printf("rx %d crc %d drop %d tx %d duty %d.%d%%\n", s.packets,
+                    s.crcFails, s.drops, s.sent, s.duty() / 10, s.duty() % 10);
+        }
+
+        uint8_t rxBuf [64];
+        auto rxLen = rf.receive(rxBuf, sizeof rxBuf);
+
+        if (rxLen >= 0) {
+            led.toggle();
+
+            printf("RF69 #%d r%d l%d a%d: ", rxLen, rf.rssi, rf.lna, rf.afc);
+            for (int i = 0; i < rxLen; ++i)
+                printf("%02x", rxBuf[i]);
+            printf("\n");
+        }
+    }
+}
@@ -0,0 +1,77 @@
+// Radio node which can be updated over the air, see jee/util-ota.h. It asks
+// node 1 for a new image at startup and then once an hour, stages it in
+// SpiFlash, and resets when it's complete, after which otaboot.cpp installs
+// it. Must be linked to run at 0x08002000, above the boot loader. On the
+// gateway, an OtaServer answers the requests passed to its handle().
+
+#include <jee.h>
+#include <jee/spi-rf69.h>
+#include <jee/spi-flash.h>
+#include <jee/util-ota.h>
+
+UartBufDev< PinA<9>, PinA<10> > console;
+
+int printf(const char* fmt, ...) {
+    va_list ap; va_start(ap, fmt); veprintf(console.putc, fmt, ap); va_end(ap);
+    return 0;
+}
+
+SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinA<4> > spi;  // default SPI1 pins
+RF69Link< decltype(spi) > rf;
+PinB<0> dio0;  // on EXTI line 0
+
+SpiGpio< PinB<15>, PinB<14>, PinB<13>, PinB<12> > spi2;
+SpiFlash< decltype(spi2) > mem;
+
+constexpr uint32_t APP = 0x2000, SIZE = 0xE000;  // same as in otaboot.cpp
+
+typedef OtaFlash< Flash, APP, 1024 > AppArea;
+typedef OtaSpiFlash< decltype(mem), 0 > StageArea;
+OtaClient< decltype(rf), AppArea, StageArea, SIZE > ota (rf);
+
+int main () {
+    console.init();
+    enableSysTick();
+    dio0.mode(Pinmode::in_float);
+    spi.init();
+    spi2.init();
+    mem.init();
+    rf.init(2, 42, 8683);  // node 2, group 42, 868.3 MHz
+    rf.listen();
+
+    VTableRam().exti0 = []() {
+        MMIO32(Periph::exti+0x14) = 1<<0;  // clear pending bit in PR
+        rf.interrupt();
+    };
+
+    MMIO32(Periph::afio+0x08) = 1<<0;    // EXTICR1: line 0 is port B
+    MMIO32(Periph::exti+0x08) |= 1<<0;   // RTSR: trigger on rising edge
+    MMIO32(Periph::exti+0x00) |= 1<<0;   // IMR: unmask line 0
+    MMIO32(0xE000E100) = 1<<6;           // NVIC: enable EXTI0 interrupt
+
+    uint32_t lastCheck = ticks - 3600000;  // check right away
+    int lastState = ota.IDLE;
+
+    while (true) {
+        if (!ota.busy() && ticks - lastCheck >= 3600000) {
+            lastCheck = ticks;
+            ota.update(1);
+        }
+
+        uint8_t buf [64];
+        int n = rf.receive(buf, sizeof buf);
+        if (n >= 0 && !ota.handle(buf, n))
+            printf("packet from %d, %d bytes\n", buf[1] & 0x3F, n - 2);
+        ota.poll();
+
+        if (ota.state != lastState) {
+            lastState = ota.state;
+            printf("ota state %d, fetched %d, copied %d, errors %d\n",
+                    ota.state, ota.fetched, ota.copied, ota.errors);
+            if (ota.state == ota.READY) {
+                wait_ms(10);
+                MMIO32(0xE000ED0C) = 0x05FA0004;  // SCB AIRCR: system reset
+            }
+        }
+    }
+}
@@ -0,0 +1,237 @@
+// Simulate a group of RF69 nodes reporting to a gateway, on the host.
+// Each node sends a reading every PERIOD ms to node 1, through RF69Link,
+// and the gateway counts what arrives. Signal levels between nodes are
+// random, so some nodes can't hear each other, i.e. hidden terminals.
+// With "ota" as first argument, node 2 fetches a firmware update from the
+// gateway instead, see jee/util-ota.h, and then installs it.
+// Build with: g++ -std=c++11 -O2 -I../.. src/main.cpp -o rf69sim
+//
+// usage: rf69sim [period-ms [loss-% [seconds]]]
+//        rf69sim ota [patched-bytes [loss-% [failing-installs]]]
+
+#include <stdio.h>
+#include <jee/sim-rf69.h>
+#include <jee/spi-rf69.h>
+
+uint32_t volatile ticks;  // kept up to date by the simulation
+
+constexpr int NODES = 25;  // node 0 is the gateway, with id 1
+
+SimChannel<NODES> air;
+RF69Link<SimSpi,NODES> nodes [NODES];  // a peer slot for each node
+
+uint32_t nextSend [NODES], sentAt [NODES], received [64];
+uint32_t offered, failed, latencySum, latencyCount, latencyMax;
+bool waiting [NODES];
+
+#include <jee/util-ota.h>
+
+constexpr uint32_t OTA_AREA = 64 * 1024, OTA_IMAGE = 50000;
+
+// an image area in RAM, with flash semantics: only erased bytes can be written
+template< int ID, int E >
+struct RamStore {
+    constexpr static int ERASE = E;
+
+    static void read (uint32_t off, void* buf, int len) {
+        memcpy(buf, mem + off, len);
+    }
+    static bool write (uint32_t off, void const* buf, int len) {
+        if (broken)
+            return false;
+        for (int i = 0; i < len; ++i) {
+            if (mem[off+i] != 0xFF)
+                return false;
+            mem[off+i] = ((uint8_t const*) buf)[i];
+        }
+        return true;
+    }
+    static void erase (uint32_t off) {
+        memset(mem + off, 0xFF, E);
+    }
+
+    static uint8_t mem [OTA_AREA + E];
+    static bool broken;  // fail all writes
+};
+
+template< int ID, int E >
+uint8_t RamStore<ID,E>::mem [OTA_AREA + E];
+template< int ID, int E >
+bool RamStore<ID,E>::broken;
+
+typedef RamStore<0,1024> ServerImage;
+typedef RamStore<1,1024> NodeApp;
+typedef RamStore<2,4096> NodeStage;   // e.g. in SpiFlash
+
+typedef RF69Link<SimSpi,NODES> Link;
+typedef OtaStage<NodeApp,NodeStage,OTA_AREA> Stage;
+OtaServer<Link,ServerImage> server (nodes[0]);
+OtaClient<Link,NodeApp,NodeStage,OTA_AREA> client (nodes[1]);
+
+// the node runs a random image, the gateway serves it with a few bytes
+// changed (or all, if patched < 0), then the node installs it at "boot",
+// with the first "failing" install attempts running into write errors
+int ota (int patched, int failing) {
+    air.latency = 30;
+    air.irq = [](int n) { nodes[n].interrupt(); };
+    for (int i = 0; i < 2; ++i) {
+        air.select(i);
+        nodes[i].init(i + 1, 42, 8683);
+        nodes[i].listen();
+    }
+
+    for (uint32_t i = 0; i < OTA_AREA; ++i)
+        NodeApp::mem[i] = ServerImage::mem[i] = rand();
+    if (patched < 0)
+        for (uint32_t i = 0; i < OTA_AREA; ++i)
+            ServerImage::mem[i] = rand();
+    else
+        for (int i = 0; i < patched; ++i)
+            ServerImage::mem[20000 + 7 * i] ^= 0x5A;
+
+    server.init(OTA_IMAGE);
+    air.select(1);
+    client.update(1);
+    uint32_t start = ticks;
+    while (client.busy() && ticks - start < 3600 * 1000U) {
+        air.run(200);
+        for (int i = 0; i < 2; ++i) {
+            air.select(i);
+            uint8_t buf [66];
+            int n = nodes[i].receive(buf, sizeof buf);
+            if (i == 0) {
+                if (n >= 0)
+                    server.handle(buf, n);
+                server.poll();
+            } else {
+                if (n >= 0)
+                    client.handle(buf, n);
+                client.poll();
+            }
+        }
+    }
+
+    printf("ota: %u-byte image, ", OTA_IMAGE);
+    if (patched < 0)
+        printf("all bytes changed, ");
+    else
+        printf("%d bytes patched, ", patched);
+    printf("%d%% random loss\n", air.loss);
+    printf("  %s after %.1f s, %u packets on the air\n",
+            client.state == client.READY ? "ready" : "failed",
+            (ticks - start) / 1000.0, air.sent);
+    printf("  blocks fetched %u, copied %u, chunks %u, bad blocks %u\n",
+            client.fetched, client.copied, client.chunks, client.errors);
+    printf("  link: acked %u, resent %u, given up %u\n",
+            nodes[1].acked, nodes[1].resent, nodes[1].lost);
+    if (client.state != client.READY)
+        return 1;
+
+    // boot once per iteration, until installed or dropped
+    for (int k = 0; k <= Stage::TRIES; ++k) {
+        NodeApp::broken = k < failing;
+        if (Stage::install()) {
+            bool same = memcmp(NodeApp::mem, ServerImage::mem, OTA_IMAGE) == 0;
+            printf("  installed at boot %d, image %s\n",
+                    k + 1, same ? "matches" : "DIFFERS");
+            return same ? 0 : 1;
+        }
+        Stage::Trailer t;
+        if (!Stage::pending(t)) {
+            printf("  not installed, dropped at boot %d\n", k + 1);
+            return 1;
+        }
+    }
+    return 1;
+}
+
+int main (int argc, const char* argv []) {
+    if (argc > 1 && strcmp(argv[1], "ota") == 0) {
+        air.loss = argc > 3 ? atoi(argv[3]) : 0;
+        srand(1);
+        return ota(argc > 2 ? atoi(argv[2]) : 100,
+                    argc > 4 ? atoi(argv[4]) : 0);
+    }
+
+    int period = argc > 1 ? atoi(argv[1]) : 1000;
+    air.loss = argc > 2 ? atoi(argv[2]) : 2;
+    int seconds = argc > 3 ? atoi(argv[3]) : 60;
+
+    srand(1);
+    // all nodes can reach the gateway, but not always each other
+    for (int i = 0; i < NODES; ++i)
+        for (int j = 0; j < i; ++j)
+            air.level[i][j] = air.level[j][i] = -40 - rand() % (j ? 50 : 35);
+
+    air.latency = 30;
+    air.irq = [](int n) { nodes[n].interrupt(); };
+
+    for (int i = 0; i < NODES; ++i) {
+        air.select(i);
+        nodes[i].init(i + 1, 42, 8683);
+        nodes[i].listen();
+        nextSend[i] = rand() % period;
+    }
+
+    while (ticks < seconds * 1000U) {
+        air.run(200);
+
+        for (int i = 0; i < NODES; ++i) {
+            auto& rf = nodes[i];
+            air.select(i);
+
+            uint8_t buf [66];
+            int n;
+            while ((n = rf.receive(buf, sizeof buf)) >= 0)
+                if (i == 0)
+                    ++received[buf[1] & 0x3F];
+
+            if (i == 0)
+                continue;
+
+            if (waiting[i] && !rf.busy(1)) {
+                waiting[i] = false;
+                uint32_t t = ticks - sentAt[i];
+                latencySum += t;
+                ++latencyCount;
+                if (t > latencyMax)
+                    latencyMax = t;
+            }
+
+            if ((int32_t) (ticks - nextSend[i]) >= 0) {
+                nextSend[i] += period;
+                uint8_t reading [10] = { (uint8_t) i };
+                ++offered;
+                if (rf.send(1, reading, sizeof reading)) {
+                    waiting[i] = true;
+                    sentAt[i] = ticks;
+                } else
+                    ++failed;  // previous one still in flight
+            }
+        }
+    }
+
+    uint32_t delivered = 0, acked = 0, resent = 0, lost = 0;
+    for (auto n : received)
+        delivered += n;
+    for (auto& rf : nodes) {
+        acked += rf.acked;
+        resent += rf.resent;
+        lost += rf.lost;
+    }
+
+    printf("%d nodes, %d s, 1 packet per %d ms per node, %d%% random loss\n",
+            NODES - 1, seconds, period, air.loss);
+    printf("  offered %u, skipped %u (busy), delivered %u (%.1f%%)\n",
+            offered, failed, delivered, 100.0 * delivered / offered);
+    printf("  acked %u, resent %u, given up %u, duplicates %u\n",
+            acked, resent, lost, nodes[0].dups);
+    printf("  latency avg %.1f ms, max %u ms\n",
+            latencyCount ? (double) latencySum / latencyCount : 0.0, latencyMax);
+    printf("  air: %u sent, %u heard, %u collisions, %u lost\n",
+            air.sent, air.heard, air.collisions, air.lost);
+    auto& s = nodes[0].stats;
+    printf("  gateway: %u rx, %u crc, %u drops, %u tx, rx air %u ms\n",
+            s.packets, s.crcFails, s.drops, s.sent, s.rxMs);
+    return 0;
+}
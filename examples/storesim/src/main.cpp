@@ -0,0 +1,271 @@
+// Check the FAT16 code in spi-sdcard.h, FlashFTL from spi-flash.h as its
+// store, and the BlockCache in util-cache.h on the host, using a RAM disk. Each check prints "ok" or what went wrong,
+// the exit code is the number of failed checks. With "bench" as argument,
+// it also compares store accesses with and without a cache.
+// Build with: g++ -std=c++11 -O2 -I../.. src/main.cpp -o storesim
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <jee/util-ramdisk.h>
+#include <jee/spi-sdcard.h>
+#include <jee/spi-flash.h>
+#include <jee/util-cache.h>
+
+typedef RamDisk<8192> Disk;  // 4 MB, just enough clusters for FAT16
+
+// write an MBR and an empty FAT16 volume with 1 sector per cluster
+template< typename S >
+void format (int sectors) {
+    uint8_t buf [512];
+    memset(buf, 0, sizeof buf);
+    *(uint32_t*) (buf+0x1C6) = 1;   // partition starts at sector 1
+    S::write512(0, buf);
+
+    int base = 1, total = sectors - base, spf = (total + 255) / 256;
+    memset(buf, 0, sizeof buf);
+    buf[0x0D] = 1;                  // sectors per cluster
+    buf[0x0E] = 1;                  // reserved sectors
+    buf[0x10] = 2;                  // fat copies
+    buf[0x11] = 512 & 0xFF;         // root dir entries
+    buf[0x12] = 512 >> 8;
+    buf[0x13] = total;
+    buf[0x14] = total >> 8;
+    buf[0x16] = spf;
+    buf[0x17] = spf >> 8;
+    S::write512(base, buf);
+
+    memset(buf, 0, sizeof buf);
+    for (int i = base + 1; i < base + 1 + 2 * spf + 32; ++i)
+        S::write512(i, buf);        // fats and root dir
+    buf[0] = 0xF8;
+    buf[1] = buf[2] = buf[3] = 0xFF;
+    S::write512(base + 1, buf);
+    S::write512(base + 1 + spf, buf);
+}
+
+int failures;
+
+void check (char const* what, bool ok) {
+    printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        ++failures;
+}
+
+void fileName (char* name, int i) {
+    memcpy(name, "FILE00  TXT", 11);
+    name[4] = '0' + i / 10;
+    name[5] = '0' + i % 10;
+}
+
+// a free slot in the first root dir sector, more entries in the next one
+void checkCreate () {
+    format<Disk>(8192);
+    FatFS<Disk> fat;
+    fat.init();
+
+    uint8_t dir [2][512];
+    memset(dir, 0, sizeof dir);
+    for (int i = 0; i < 20; ++i) {
+        uint8_t* p = dir[i/16] + (i%16) * 32;
+        fileName((char*) p, i);
+        p[11] = 0x20;
+    }
+    dir[0][0] = 0xE5;  // entry 0 has been deleted
+    Disk::write512(fat.rdir, dir[0]);
+    Disk::write512(fat.rdir + 1, dir[1]);
+
+    FileMap<FatFS<Disk>,4> file (fat);
+    check("create in a deleted slot", file.create("NEWFILE TXT") == 0 &&
+                                        file.entry == fat.rdir * 16);
+
+    uint8_t buf [512];
+    Disk::read512(fat.rdir, buf);
+    check("first dir sector keeps its entries",
+            memcmp(buf, "NEWFILE TXT", 11) == 0 &&
+            memcmp(buf + 32, dir[0] + 32, 512 - 32) == 0);
+    Disk::read512(fat.rdir + 1, buf);
+    check("second dir sector is unchanged", memcmp(buf, dir[1], 512) == 0);
+
+    bool all = true;
+    for (int i = 1; i < 20; ++i) {
+        char name [11];
+        fileName(name, i);
+        all = all && file.open(name) == 0;
+    }
+    check("all other files can still be opened", all);
+}
+
+// a FAT16 volume needs at least 4085 data clusters, i.e. some 2 MB of flash
+typedef RamFlash<2480> Flash;
+typedef FlashFTL<Flash,620,4200> Ftl;
+
+void checkFlash () {
+    Flash::wipe();
+    Ftl::init();
+    format<Ftl>(4200);
+    FatFS<Ftl> fat;
+    fat.init();
+    // 4199 sectors, less 1 reserved, 2x 17 fat, and 32 root dir sectors
+    check("cluster limit counts data sectors only", fat.clim == 4132 + 2);
+    FileMap<FatFS<Ftl>,4> file (fat);
+
+    uint8_t out [16*512], in [16*512];
+    for (unsigned i = 0; i < sizeof out; ++i)
+        out[i] = i * 7 + i / 512;
+    bool ok = file.create("FLASH   DAT") == 0 && file.reserve(sizeof out) &&
+                file.writeRange(0, out, 16);
+    file.length = sizeof out;
+    file.commit();
+    check("file on flash, written", ok);
+
+    Ftl::init();  // as after a restart, rebuilds the block map
+    fat.init();
+    Flash::reads = 0;
+    memset(in, 0, sizeof in);
+    ok = file.open("FLASH   DAT") == (int) sizeof out &&
+            file.readRange(0, in, 16);
+    check("file on flash, read back", ok && memcmp(in, out, sizeof in) == 0);
+    check("runs of slots read in one go", Flash::reads < 16);
+}
+
+typedef RamDisk<16> Small;
+
+// a store with only single-block calls
+struct Plain {
+    static void read512 (int n, void* p) { Small::read512(n, p); }
+    static void write512 (int n, void const* p) { Small::write512(n, p); }
+};
+
+void checkCache () {
+    for (int i = 0; i < 16; ++i)
+        memset(Small::data[i], i + 1, 512);
+    uint8_t buf [4*512];
+
+    // statics start out zeroed, which must not look like a cached block 0
+    typedef BlockCache<Small,512,2> Fresh;
+    Fresh::read(0, buf);
+    check("no block 0 hit before init", buf[0] == 1 && Fresh::misses == 1);
+
+    typedef BlockCache<Small,512,4,1,4> Ahead;
+    Ahead::init(16);
+    Small::reads = 0;
+    Ahead::read(14, buf);
+    check("read-ahead stops at the end", Small::reads == 2 && buf[0] == 15);
+    Ahead::read(15, buf);
+    check("read-ahead block is a hit", Ahead::hits == 1 && buf[0] == 16);
+
+    typedef BlockCache<Plain,512,4> Cache;
+    Cache::init();
+    memset(buf, 0xAA, 512);
+    Cache::write(5, buf);
+    Cache::readMulti(4, buf, 3);
+    check("multi read without store support", buf[0] == 5 &&
+            buf[512] == 0xAA && buf[1024] == 7 && Small::data[5][0] == 0xAA);
+    memset(buf, 0x55, 2*512);
+    Cache::writeMulti(8, buf, 2);
+    Cache::read(9, buf);
+    check("multi write without store support", Small::data[8][0] == 0x55 &&
+            buf[0] == 0x55 && Cache::misses == 2);
+}
+
+uint32_t seed = 1;
+
+int pick (int n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+const int FILES = 20, SIZE = 32, OPS = 20000;
+
+// set up FILES files of SIZE sectors each, directly on the disk
+void benchSetup () {
+    format<Disk>(8192);
+    FatFS<Disk> fat;
+    fat.init();
+    FileMap<FatFS<Disk>,4> file (fat);
+    uint8_t buf [SIZE*512];
+    for (int i = 0; i < FILES; ++i) {
+        char name [11];
+        fileName(name, i);
+        memset(buf, i, sizeof buf);
+        file.create(name);
+        file.reserve(sizeof buf);
+        file.writeRange(0, buf, SIZE);
+        file.length = sizeof buf;
+        file.commit();
+    }
+}
+
+void initCache (Disk*) {}
+
+template< typename T, int B, int W, int S, int AHEAD >
+void initCache (BlockCache<T,B,W,S,AHEAD>*) {
+    BlockCache<T,B,W,S,AHEAD>::init(8192);
+}
+
+void flushCache (Disk*) {}
+
+template< typename T, int B, int W, int S, int AHEAD >
+void flushCache (BlockCache<T,B,W,S,AHEAD>*) {
+    BlockCache<T,B,W,S,AHEAD>::flush();
+}
+
+void showCache (Disk*) {}
+
+template< typename T, int B, int W, int S, int AHEAD >
+void showCache (BlockCache<T,B,W,S,AHEAD>*) {
+    typedef BlockCache<T,B,W,S,AHEAD> C;
+    printf(" %5.1f%%", 100.0 * C::hits / (C::hits + C::misses));
+}
+
+// open random files and read or rewrite a random sector in each
+template< typename S >
+void bench (char const* label) {
+    benchSetup();
+    seed = 1;
+    Disk::calls = Disk::reads = Disk::writes = 0;
+    clock_t start = clock();
+
+    initCache((S*) 0);
+    FatFS<S> fat;
+    fat.init();
+    FileMap<FatFS<S>,4> file (fat);
+    uint8_t buf [512];
+    for (int i = 0; i < OPS; ++i) {
+        char name [11];
+        fileName(name, pick(FILES));
+        file.open(name);
+        int sect = pick(SIZE);
+        if (pick(4) == 0)
+            file.writeRange(sect, buf, 1);
+        else
+            file.readRange(sect, buf, 1);
+    }
+    flushCache((S*) 0);
+
+    double us = 1e6 * (clock() - start) / CLOCKS_PER_SEC / OPS;
+    printf("%-22s %6.2f %6.2f %6.2f %6.2f", label, (double) Disk::calls / OPS,
+            (double) Disk::reads / OPS, (double) Disk::writes / OPS, us);
+    showCache((S*) 0);
+    printf("\n");
+}
+
+int main (int argc, char const** argv) {
+    checkCreate();
+    checkFlash();
+    checkCache();
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        printf("\n%d ops, per op:       calls  reads writes     us   hits\n",
+                OPS);
+        bench< Disk >("no cache");
+        bench< BlockCache<Disk,512,4> >("4 lines");
+        bench< BlockCache<Disk,512,16> >("16 lines");
+        bench< BlockCache<Disk,512,8,4> >("4 sets of 8 lines");
+        bench< BlockCache<Disk,512,16,1,2> >("16 lines, 2 ahead");
+    }
+    return failures;
+}
@@ -3,6 +3,7 @@
 
 #include <jee.h>
 #include <jee/spi-rf69.h>
+#include <jee/util-spectrum.h>
 #include <jee/spi-ili9325.h>
 #include <jee/spi-ili9341.h>
 
@@ -25,6 +26,7 @@ ILI9341< decltype(spiA), PinA<3> > lcd;
 // controlling the radio takes most time, use hardware SPI @ 9 MHz for it
 SpiHw< PinA<7>, PinA<6>, PinA<5>, PinA<4> > spiB;
 RF69< decltype(spiB) > rf;
+SpectrumScanner< decltype(rf) > scanner (rf);
 
 PinA<1> led;
 
@@ -96,33 +98,21 @@ int main () {
     }
     printf("\n");
 
-    rf.setMode(rf.MODE_RECEIVE);
+    // 868.3 MHz, with 80 steps of 61.03515625 Hz per pixel, a sweep can cover
+    // 240*80*61.03515625 = 1,171,875 Hz, i.e. slightly under ± 600 kHz
+    scanner.init(868300000, 4883, lcd.width);  // 915000000 for 915.0 MHz
 
     while (true) {
         uint32_t start = ticks;
 
         for (int y = 0; y < lcd.height; ++y) {
-            // 868.3 MHz = 0xD91300, with 80 steps per pixel, a sweep can cover
-            // 240*80*61.03515625 = 1,171,875 Hz, i.e. slightly under ± 600 kHz
-            constexpr uint32_t middle = 0xD91300;  // 0xE4C000 for 915.0 MHz
-            constexpr uint32_t step = 80;
-            uint32_t first = middle - 120 * step;
-
+            static uint8_t rssiRow [lcd.width];
             static uint16_t pixelRow [lcd.width];
 
-            for (int x = 0; x < lcd.width; ++x) {
-                // step to a new frequency
-                uint32_t freq = first + x * step;
-                rf.writeReg(rf.REG_FRFMSB,   freq >> 16);
-                rf.writeReg(rf.REG_FRFMSB+1, freq >> 8);
-                rf.writeReg(rf.REG_FRFMSB+2, freq);
-
-                // take the average of 16 RSSI readings
-                int sum = 0;
-                for (int i = 0; i < 16; ++i)
-                    sum += rf.readReg(rf.REG_RSSIVALUE);
-                uint8_t rssi = ~sum >> 4;
+            scanner.sweep(rssiRow);
 
+            for (int x = 0; x < lcd.width; ++x) {
+                uint8_t rssi = rssiRow[x];
                 // add some grid points for reference
                 if ((y & 0x1F) == 0 && x % 40 == 0)
                     rssi = 0xFF; // white dot
@@ -134,7 +124,8 @@ int main () {
             lcd.pixels(0, y, pixelRow, lcd.width);  // update the display
         }
 
-        printf("%d ms\n", ticks - start);
+        printf("%d ms, %d.%d sweeps/s\n", ticks - start,
+                scanner.rate() / 10, scanner.rate() % 10);
         led.toggle();
     }
 }
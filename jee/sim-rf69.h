@@ -0,0 +1,432 @@
+// Host-side simulation of RF69 radios sharing the air, for testing drivers
+// and protocols on Linux/macOS, without hardware. Each SimRadio models the
+// registers, fifo, and mode changes of one RFM69, as far as the RF69 driver
+// uses them. SimSpi talks to the currently selected radio, so that one type
+// can be used for all nodes, e.g. "RF69Irq<SimSpi> nodes [N]".
+//
+// SimChannel<N> connects N radios: a packet is heard by all nodes in receive
+// mode on the same frequency and sync word, with a per-link signal level in
+// dBm. Packets are lost at random (loss in %), or when they overlap with
+// another one heard less than 6 dB weaker. Bytes move between the fifo and
+// the air at the bit rate, so packets over 65 bytes only get through if the
+// driver keeps up, i.e. underruns and overruns are modelled as well. DIO0
+// interrupts are delivered to the irq handler, on the rising edge, and DIO1
+// interrupts to irq1, on both edges, after a fixed latency. Time is simulated,
+// in us, and the global "ticks" follows it in ms, as SysTick would. As with
+// jee.cpp on the target, "ticks" must be defined once in the application.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern uint32_t volatile ticks;
+
+struct SimRadio {
+    uint8_t regs [0x80];
+    uint8_t fifo [66];  // ring buffer
+    int fifoHead, fifoCount;
+    int id;
+    int lock;           // frame being received, or -1
+    int rxBytes;        // bytes of that frame put in the fifo so far
+    bool corrupt;       // the frame being received will fail its crc
+    bool dio0, dio1;    // last level of the DIO pins
+    uint32_t irqAt;     // when to call the irq handler, if irqPending
+    uint32_t irq1At;    // same for irq1
+    bool irqPending, irq1Pending;
+
+    enum { SLEEP, STANDBY, SYNTH, TRANSMIT, RECEIVE };
+
+    void reset (int n) {
+        memset(this, 0, sizeof *this);
+        id = n;
+        lock = -1;
+        regs[0x01] = 0x04;  // standby
+        regs[0x03] = 0x1A;  // 4.8 kbps
+        regs[0x04] = 0x0B;
+        regs[0x2D] = 0x03;  // preamble
+        regs[0x2E] = 0x98;  // sync on, 4 bytes
+        regs[0x29] = 0xE4;  // RssiThresh
+        regs[0x38] = 0x40;  // PayloadLength
+        regs[0x3C] = 0x8F;  // FifoThresh
+        regs[0x24] = 0xFF;
+        regs[0x27] = 0x80;  // ModeReady
+    }
+
+    int mode () const { return (regs[0x01] >> 2) & 7; }
+    uint32_t freq () const { return (regs[0x07] << 16) | (regs[0x08] << 8) | regs[0x09]; }
+    int syncSize () const { return ((regs[0x2E] >> 3) & 7) + 1; }
+
+    bool push (uint8_t v) {
+        if (fifoCount >= (int) sizeof fifo) {
+            regs[0x28] |= 0x10;  // FifoOverrun
+            return false;
+        }
+        fifo[(fifoHead + fifoCount++) % sizeof fifo] = v;
+        return true;
+    }
+    int pop () {
+        if (fifoCount == 0)
+            return -1;
+        uint8_t v = fifo[fifoHead];
+        fifoHead = (fifoHead + 1) % sizeof fifo;
+        --fifoCount;
+        return v;
+    }
+    void clearFifo () { fifoHead = fifoCount = 0; }
+
+    // FifoFull, FifoNotEmpty, and FifoLevel in RegIrqFlags2
+    uint8_t fifoFlags () const {
+        return (fifoCount >= (int) sizeof fifo ? 0x80 : 0) |
+                (fifoCount > 0 ? 0x40 : 0) |
+                (fifoCount > (regs[0x3C] & 0x7F) ? 0x20 : 0);
+    }
+
+    bool sameNet (SimRadio const& r) const {
+        return freq() == r.freq() && syncSize() == r.syncSize() &&
+                memcmp(regs + 0x2F, r.regs + 0x2F, syncSize()) == 0;
+    }
+
+    // bytes in us, at the current bit rate
+    uint32_t bytesToUs (int n) const {
+        return (n * ((regs[0x03] << 8) | regs[0x04])) >> 2;
+    }
+    uint32_t preambleUs () const {
+        return bytesToUs((regs[0x2C] << 8) + regs[0x2D] + syncSize());
+    }
+
+    bool readDio0 () const {
+        uint8_t map = regs[0x25] >> 6;
+        uint8_t f1 = regs[0x27], f2 = regs[0x28];
+        switch (mode()) {
+            case TRANSMIT: return map == 0 ? (f2 & 0x08) : (f2 & 0x20) != 0;
+            case RECEIVE:  return map == 0 ? (f2 & 0x02) :
+                                  map == 1 ? (f2 & 0x04) :
+                                  map == 2 ? (f1 & 0x01) : (f1 & 0x08) != 0;
+        }
+        return false;
+    }
+
+    bool readDio1 () const {
+        uint8_t map = (regs[0x25] >> 4) & 3;
+        return map == 0 ? (fifoFlags() & 0x20) :
+               map == 1 ? (fifoFlags() & 0x80) : false;
+    }
+
+    // leave or (re-)enter receive mode, i.e. drop any partial reception
+    void restart () {
+        lock = -1;
+        rxBytes = 0;
+        clearFifo();
+        regs[0x27] &= ~0x49;  // RxReady, Rssi, SyncAddressMatch
+        regs[0x28] &= ~0x56;  // FifoNotEmpty, FifoOverrun, PayloadReady, CrcOk
+        if (mode() == RECEIVE)
+            regs[0x27] |= 0x40;
+    }
+};
+
+struct SimFrame {
+    int from;
+    uint32_t start, sync, end;  // in us
+    uint8_t data [256];         // length byte, followed by the packet
+    int sent;                   // bytes taken from the sender's fifo so far
+    bool bad;                   // the sender's fifo ran dry
+    bool done;
+};
+
+template< int N >
+struct SimChannel {
+    SimRadio radios [N];
+    int8_t level [N][N];    // signal strength from i to j in dBm
+    int loss;               // random loss, in %
+    uint32_t latency;       // interrupt latency, in us
+    uint32_t now, prev;     // simulated time, in us
+    void (*irq)(int node);  // called on the rising edge of DIO0
+    void (*irq1)(int node); // called on both edges of DIO1
+
+    enum { FRAMES = 32, NOISE = -110 };
+    SimFrame frames [FRAMES];
+
+    uint32_t sent, heard, collisions, lost;  // statistics
+
+    SimChannel () : loss (0), latency (20), now (0), prev (0), irq (0), irq1 (0) {
+        for (int i = 0; i < N; ++i) {
+            radios[i].reset(i);
+            for (int j = 0; j < N; ++j)
+                level[i][j] = -60;
+        }
+        for (auto& f : frames)
+            f.done = true;
+        sent = heard = collisions = lost = 0;
+    }
+
+    static SimChannel*& current () {
+        static SimChannel* p;
+        return p;
+    }
+
+    void select (int n);
+
+    // advance time, processing all radio events and interrupts on the way
+    void run (uint32_t us, uint32_t step =10) {
+        for (uint32_t end = now + us; (int32_t) (end - now) > 0; ) {
+            prev = now;
+            now += step;
+            ticks = now / 1000;
+            update();
+            for (int i = 0; i < N; ++i) {
+                SimRadio& r = radios[i];
+                if (r.irqPending && (int32_t) (now - r.irqAt) >= 0) {
+                    r.irqPending = false;
+                    select(i);
+                    if (irq)
+                        irq(i);
+                }
+                if (r.irq1Pending && (int32_t) (now - r.irq1At) >= 0) {
+                    r.irq1Pending = false;
+                    select(i);
+                    if (irq1)
+                        irq1(i);
+                }
+            }
+        }
+    }
+
+    int rssiAt (int node) const {
+        int best = NOISE;
+        for (auto& f : frames)
+            if (!f.done && f.from != node && (int32_t) (now - f.start) >= 0 &&
+                    level[f.from][node] > best)
+                best = level[f.from][node];
+        return best;
+    }
+
+    void transmit (int node) {
+        SimRadio& r = radios[node];
+        if (r.fifoCount == 0)
+            return;
+        for (auto& f : frames)
+            if (f.done) {
+                int len = r.fifo[r.fifoHead];  // the rest follows later
+                f.from = node;
+                f.start = now;
+                f.sync = now + r.preambleUs();
+                f.end = f.sync + r.bytesToUs(len + 1 + 2);  // length and crc
+                f.sent = 0;
+                f.bad = false;
+                f.done = false;
+                ++sent;
+                break;
+            }
+    }
+
+    // the sender takes each byte from its fifo just before it goes out
+    void feed (SimFrame& f) {
+        SimRadio& r = radios[f.from];
+        while (f.sent == 0 || f.sent <= f.data[0]) {
+            if ((int32_t) (now - f.sync - r.bytesToUs(f.sent)) < 0)
+                break;
+            int v = r.mode() == SimRadio::TRANSMIT ? r.pop() : -1;
+            if (v < 0)
+                f.bad = true;  // underrun, this packet is garbage
+            f.data[f.sent++] = v;
+        }
+    }
+
+    // the receiver puts each byte in its fifo once it has come in
+    void fill (SimRadio& r, SimFrame& f) {
+        while (r.lock >= 0 && r.rxBytes < f.sent) {
+            if ((int32_t) (now - f.sync - r.bytesToUs(r.rxBytes + 1)) < 0)
+                break;
+            if (r.rxBytes == 0 && r.regs[0x38] != 0 && f.data[0] > r.regs[0x38]) {
+                r.restart();  // too long for PayloadLength
+                return;
+            }
+            if (!r.push(f.data[r.rxBytes++]))
+                r.corrupt = true;
+        }
+    }
+
+    void update () {
+        for (int k = 0; k < FRAMES; ++k) {
+            SimFrame& f = frames[k];
+            if (f.done)
+                continue;
+            feed(f);
+            for (int i = 0; i < N; ++i) {
+                SimRadio& r = radios[i];
+                if (i == f.from)
+                    continue;
+                if (r.lock < 0 && (int32_t) (now - f.sync) >= 0 &&
+                        (int32_t) (f.sync - prev) > 0)
+                    startRx(r, k);
+                if (r.lock == k)
+                    fill(r, f);
+                if (r.lock == k && (int32_t) (now - f.end) >= 0)
+                    endRx(r, f);
+            }
+            if ((int32_t) (now - f.end) >= 0) {
+                f.done = true;
+                SimRadio& r = radios[f.from];
+                if (r.mode() == SimRadio::TRANSMIT)
+                    r.regs[0x28] |= 0x08;  // PacketSent
+            }
+        }
+        for (int i = 0; i < N; ++i)
+            edge(radios[i]);
+    }
+
+    // sync word seen: lock on if the packet is audible and for this network
+    void startRx (SimRadio& r, int k) {
+        SimFrame& f = frames[k];
+        int dbm = level[f.from][r.id];
+        if (r.mode() != SimRadio::RECEIVE || !r.sameNet(radios[f.from]) ||
+                -2 * dbm > r.regs[0x29] || (r.regs[0x28] & 0x04))
+            return;  // not listening, not for us, too weak, or fifo in use
+        r.lock = k;
+        r.rxBytes = 0;
+        r.corrupt = rand() % 100 < loss;
+        if (r.corrupt)
+            ++lost;
+        r.regs[0x27] |= 0x09;         // SyncAddressMatch, Rssi
+        r.regs[0x24] = -2 * dbm;
+        r.regs[0x18] = (dbm > -50 ? 6 : dbm > -70 ? 3 : 1) << 3;
+        int16_t afc = (f.from * 37) % 41 - 20;  // a fixed offset per sender
+        r.regs[0x1F] = afc >> 8;
+        r.regs[0x20] = afc;
+    }
+
+    // end of packet: check for collisions, then keep the fifo or drop it
+    void endRx (SimRadio& r, SimFrame& f) {
+        int dbm = level[f.from][r.id];
+        if (f.bad)
+            r.corrupt = true;
+        for (auto& g : frames)
+            if (&g != &f && !g.done && g.from != r.id &&
+                    (int32_t) (g.end - f.start) > 0 &&
+                    (int32_t) (f.end - g.start) > 0 &&
+                    level[g.from][r.id] > dbm - 6) {
+                if (!r.corrupt)
+                    ++collisions;
+                r.corrupt = true;
+            }
+        bool keep = !r.corrupt || (r.regs[0x37] & 0x08);  // CrcAutoClearOff
+        if (!keep) {
+            r.restart();
+            return;
+        }
+        r.lock = -1;
+        if (!r.corrupt)
+            ++heard;
+        r.regs[0x28] |= 0x04 | (r.corrupt ? 0 : 0x02);
+    }
+
+    void edge (SimRadio& r) {
+        bool level = r.readDio0();
+        if (level && !r.dio0 && !r.irqPending) {
+            r.irqPending = true;
+            r.irqAt = now + latency;
+        }
+        r.dio0 = level;
+        level = r.readDio1();
+        if (level != r.dio1 && !r.irq1Pending) {
+            r.irq1Pending = true;
+            r.irq1At = now + latency;
+        }
+        r.dio1 = level;
+    }
+
+    // SPI register access on the selected radio
+    uint8_t access (SimRadio& r, uint8_t addr, bool write, uint8_t val) {
+        uint8_t old = r.regs[addr];
+        switch (addr) {
+            case 0x00:
+                if (write)
+                    r.push(val);
+                else {
+                    int v = r.pop();
+                    old = v < 0 ? 0 : v;
+                    if (r.fifoCount == 0 && (r.regs[0x28] & 0x04) &&
+                            r.mode() == SimRadio::RECEIVE)
+                        r.restart();  // emptied after PayloadReady, AutoRxRestartOn
+                }
+                break;
+            case 0x01:
+                if (write) {
+                    int prev = r.mode();
+                    r.regs[addr] = val;
+                    if (prev == SimRadio::TRANSMIT && r.mode() != prev) {
+                        r.regs[0x28] &= ~0x08;  // PacketSent
+                        r.clearFifo();
+                    }
+                    if (r.mode() != prev &&
+                            (prev == SimRadio::RECEIVE || r.mode() == SimRadio::RECEIVE))
+                        r.restart();
+                    if (r.mode() == SimRadio::TRANSMIT && prev != SimRadio::TRANSMIT)
+                        transmit(r.id);
+                }
+                break;
+            case 0x24:
+                if (r.mode() == SimRadio::RECEIVE && r.lock < 0)
+                    r.regs[addr] = -2 * rssiAt(r.id);
+                old = r.regs[addr];
+                break;
+            case 0x27:
+                break;  // read-only
+            case 0x28:
+                if (write && (val & 0x10)) {
+                    r.regs[addr] &= ~0x10;  // clearing FifoOverrun also
+                    r.clearFifo();          // clears the fifo
+                }
+                old = (r.regs[addr] & ~0xE0) | r.fifoFlags();
+                break;
+            default:
+                if (write)
+                    r.regs[addr] = val;
+        }
+        edge(r);
+        return old;
+    }
+};
+
+// all nodes share the same SPI type, it talks to the selected radio
+template< int ID =0 >
+struct SimSpiDev {
+    static SimRadio* radio;
+    static uint8_t (*access)(SimRadio&, uint8_t, bool, uint8_t);
+    static int pos;
+    static uint8_t addr;
+
+    static void enable () { pos = 0; }
+    static void disable () {}
+
+    static uint8_t transfer (uint8_t v) {
+        if (pos++ == 0) {
+            addr = v;
+            return 0;
+        }
+        uint8_t r = access(*radio, addr & 0x7F, addr & 0x80, v);
+        if ((addr & 0x7F) != 0)
+            ++addr;  // auto-increment, except for the fifo
+        return r;
+    }
+};
+
+template< int ID >
+SimRadio* SimSpiDev<ID>::radio;
+template< int ID >
+uint8_t (*SimSpiDev<ID>::access)(SimRadio&, uint8_t, bool, uint8_t);
+template< int ID >
+int SimSpiDev<ID>::pos;
+template< int ID >
+uint8_t SimSpiDev<ID>::addr;
+
+typedef SimSpiDev<> SimSpi;
+
+template< int N >
+void SimChannel<N>::select (int n) {
+    current() = this;
+    SimSpi::radio = radios + n;
+    SimSpi::access = [](SimRadio& r, uint8_t a, bool w, uint8_t v) {
+        return current()->access(r, a, w, v);
+    };
+}
@@ -1,6 +1,9 @@
 // Driver for WinBond W25Qxx spi flash memory
 // see https://jeelabs.org/ref/W25Q128F.pdf
 
+#include <string.h>
+#include "util-crc.h"
+
 template< typename SPI >
 class SpiFlash {
     static void cmd (int arg) {
@@ -25,9 +28,53 @@ class SpiFlash {
         SPI::transfer(offset >> 8);
         SPI::transfer(offset);
     }
+    static void waddr (uint32_t offset) {
+        if (abytes > 3)
+            SPI::transfer(offset >> 24);
+        w24b(offset);
+    }
+    // read one 32-bit little-endian word from the SFDP tables
+    static uint32_t sfdp (int addr) {
+        cmd(0x5A);
+        w24b(addr);
+        SPI::transfer(0);
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i)
+            v |= SPI::transfer(0) << (8*i);
+        SPI::disable();
+        return v;
+    }
+    // the 4-byte address form of an erase command, or 0 if there is none
+    static int erase4 (int op) {
+        switch (op) {
+            case 0x20: return 0x21;  // 4 KB
+            case 0x52: return 0x5C;  // 32 KB
+            case 0xD8: return 0xDC;  // 64 KB
+        }
+        return 0;
+    }
 
 public:
-    static void init () {}
+    // get the chip's parameters from SFDP, if supported (see JESD216)
+    static void init () {
+        if (sfdp(0) != 0x50444653)  // "SFDP"
+            return;
+        int words = sfdp(0x08) >> 24;           // length of basic table
+        int bfpt = sfdp(0x0C) & 0xFFFFFF;       // location of basic table
+        uint32_t w1 = sfdp(bfpt), w2 = sfdp(bfpt + 4);
+
+        if ((w1 & 3) == 1)
+            eraseOp = w1 >> 8;                  // 4 KB erase is supported
+
+        uint32_t mbit = w2 & (1U<<31) ? 1U << ((w2 & 0x1F) - 20) :
+                                        (w2 >> 20) + 1;
+        kb = mbit << 7;
+        if (kb > 16384 && (w1 & (3<<17)) != 0)
+            abytes = 4;                         // use 4-byte address cmds
+
+        if (words >= 11)
+            psize = 1 << ((sfdp(bfpt + 40) >> 4) & 0xF);
+    }
 
     static void reset () {
         cmd(0x66);
@@ -46,32 +93,44 @@ public:
     }
 
     static int size () {
+        if (kb > 0)
+            return kb;  // as reported by SFDP
         // works for WinBond W25Qxx, e.g. W25Q64 => 0xC84017 => 8192 KB
         return 1 << ((devId() & 0xFF) - 10);
     }
 
     static void wipe () {
-        wcmd(0xC7); // 0x60 doesn't work on Micron Tech (N25Q)
-        wait();
+        beginWipe();
+        finish();
     }
 
-    static void erase (int page) {
-        wcmd(0x20);
-        w24b(page<<8);
-        wait();
+    // returns false if the erase command can't be used, see beginErase
+    static bool erase (int page) {
+        if (!beginErase(page))
+            return false;
+        finish();
+        return true;
     }
 
     static void read256 (int page, void* buf) {
         read(page<<8, buf, 256);
     }
 
+    // an erase in progress is suspended while reading, a program completed
     static void read (int offset, void* buf, int cnt) {
-        cmd(0x0B);
-        w24b(offset);
+        bool susp = state == ERASING && busy();
+        if (susp)
+            suspend();
+        else
+            finish();
+        cmd(abytes > 3 ? 0x0C : 0x0B);  // fast read
+        waddr(offset);
         SPI::transfer(0);
         for (int i = 0; i < cnt; ++i)
             ((uint8_t*) buf)[i] = SPI::transfer(0);
         SPI::disable();
+        if (susp)
+            resume();
     }
 
     static void write256 (int page, const void* buf) {
@@ -79,10 +138,533 @@ public:
     }
 
     static void write (int offset, const void* buf, int cnt) {
-        wcmd(0x02);
-        w24b(offset);
-        for (int i = 0; i < cnt; ++i)
-            SPI::transfer(((uint8_t*) buf)[i]);
+        beginProgram(offset, buf, cnt);
+        finish();
+    }
+
+    // the begin* calls start an operation and return right away, after
+    // which poll() must be called until it returns false - the buffer passed
+    // to beginProgram() has to stay valid until then
+
+    static void beginWipe () {
+        finish();
+        wcmd(0xC7); // 0x60 doesn't work on Micron Tech (N25Q)
+        SPI::disable();
+        state = ERASING;
+    }
+
+    // with 4-byte addresses, the erase command needs a matching 4-byte form,
+    // else nothing is erased and this returns false
+    static bool beginErase (int page) {
+        int op = abytes > 3 ? erase4(eraseOp) : eraseOp;
+        if (op == 0)
+            return false;
+        finish();
+        wcmd(op);
+        waddr(page<<8);
+        SPI::disable();
+        state = ERASING;
+        return true;
+    }
+
+    // writes are split up so that each page program stays within one page
+    static void beginProgram (int offset, const void* buf, int cnt) {
+        finish();
+        pOff = offset;
+        pBuf = (uint8_t const*) buf;
+        pCnt = cnt;
+        state = PROGRAMMING;
+        poll();
+    }
+
+    static bool busy () {
+        cmd(0x05);
+        bool f = SPI::transfer(0) & 1;
+        SPI::disable();
+        return f;
+    }
+
+    // returns true as long as the current operation has not yet completed
+    static bool poll () {
+        if (state == IDLE || busy())
+            return state != IDLE;
+        if (state == PROGRAMMING && pCnt > 0) {
+            int n = psize - pOff % psize;
+            if (n > pCnt)
+                n = pCnt;
+            wcmd(abytes > 3 ? 0x12 : 0x02);
+            waddr(pOff);
+            for (int i = 0; i < n; ++i)
+                SPI::transfer(pBuf[i]);
+            SPI::disable();
+            pOff += n;
+            pBuf += n;
+            pCnt -= n;
+            return true;
+        }
+        state = IDLE;
+        return false;
+    }
+
+    static void finish () {
+        while (poll())
+            ;
+    }
+
+    // erase suspend takes up to some 20 µs, after which the rest of the chip
+    // can be read - a resume must be followed by ~20 µs of progress before
+    // the next suspend, or the erase may never complete
+    static void suspend () {
+        cmd(0x75);
         wait();
     }
+
+    static void resume () {
+        cmd(0x7A);
+        SPI::disable();
+    }
+
+    static uint32_t kb;         // chip size in KB, 0 if unknown
+    static uint16_t psize;      // page size for programming
+    static uint8_t abytes;      // 3 or 4 address bytes
+    static uint8_t eraseOp;     // 4 KB sector erase command
+
+    enum { IDLE, ERASING, PROGRAMMING };
+    static uint8_t state;       // operation in progress, if any
+    static int pOff, pCnt;      // what remains of the current program
+    static uint8_t const* pBuf;
+};
+
+template< typename SPI >
+uint32_t SpiFlash<SPI>::kb;
+template< typename SPI >
+uint16_t SpiFlash<SPI>::psize = 256;
+template< typename SPI >
+uint8_t SpiFlash<SPI>::abytes = 3;
+template< typename SPI >
+uint8_t SpiFlash<SPI>::eraseOp = 0x20;
+template< typename SPI >
+uint8_t SpiFlash<SPI>::state;
+template< typename SPI >
+int SpiFlash<SPI>::pOff;
+template< typename SPI >
+int SpiFlash<SPI>::pCnt;
+template< typename SPI >
+uint8_t const* SpiFlash<SPI>::pBuf;
+
+// Flash translation layer, presents 512-byte blocks on top of SpiFlash, so
+// that it can be used as store for FatFS. Writes are appended to a circular
+// log of 4 KB erase sectors, the oldest sector gets reclaimed (its live
+// blocks copied to the head) when the log is about to wrap onto it. This
+// spreads erases evenly over all sectors. At least 3 sectors must be kept
+// as spare room, more spare room means fewer block copies during reclaim.
+// The block map is kept in RAM and rebuilt from sector headers in init().
+//
+// Sector layout: 512-byte header, then 7 data slots of 512 bytes each.
+// A slot is written as: tag (block nr) in header, data, then "done" marker,
+// so an interrupted write is never mistaken for valid data after power-up.
+
+template< typename F, int SECTORS, int BLOCKS, int FIRST =0 >
+struct FlashFTL {
+    constexpr static int SLOTS = 7;
+    constexpr static uint32_t MAGIC = 0x4C544635;  // "5FTL"
+    static_assert(BLOCKS <= (SECTORS - 3) * SLOTS, "not enough spare room");
+    static_assert((SECTORS << 3) <= 0xFFFF, "too many sectors for the map");
+
+    struct Header {
+        uint32_t magic;
+        uint32_t seq;               // increases with each newly used sector
+        uint32_t seqInv;            // ~seq, cleared when a sector is retired
+        uint32_t erases;            // wear count, informational
+        uint16_t tag [SLOTS];       // block number stored in each slot
+        uint16_t done [SLOTS];      // 0 once the slot has been written
+    };
+
+    static void init () {
+        for (int i = 0; i < BLOCKS; ++i)
+            map[i] = 0xFFFF;
+
+        // find the most recently used sector, that's where the head is
+        Header h;
+        int newest = -1;
+        for (int s = 0; s < SECTORS; ++s)
+            if (header(s, h) && (newest < 0 || (int32_t) (h.seq - seq) > 0)) {
+                newest = s;
+                seq = h.seq;
+            }
+        if (newest < 0) {  // empty flash
+            head = tail = seq = 0;
+            format(head);
+            fill = 0;
+            return;
+        }
+        head = newest;
+
+        // replay from oldest to newest, later copies supersede earlier ones
+        tail = next(head);
+        while (!header(tail, h))
+            tail = next(tail);
+        for (int s = tail; ; s = next(s)) {
+            if (header(s, h))
+                for (int i = 0; i < SLOTS; ++i)
+                    if (h.tag[i] < BLOCKS && h.done[i] == 0)
+                        map[h.tag[i]] = (s << 3) + i;
+            if (s == head)
+                break;
+        }
+
+        // skip past all slots in the head which were started
+        for (fill = 0; fill < SLOTS && h.tag[fill] != 0xFFFF; ++fill) {}
+
+        // finish a reclaim which may have been interrupted
+        while (spare() < 2 * SLOTS)
+            reclaim();
+    }
+
+    static void read512 (int n, void* buf) {
+        if (n < BLOCKS && map[n] != 0xFFFF)
+            F::read(offset(map[n]), buf, 512);
+        else
+            memset(buf, 0xFF, 512);
+    }
+
+    // blocks written in sequence usually end up in consecutive slots of the
+    // same sector, those runs are read in one go, writes go one at a time
+    static void readMulti (int n, void* buf, int cnt) {
+        uint8_t* p = (uint8_t*) buf;
+        while (cnt > 0) {
+            int k = 1;
+            if (n < BLOCKS && map[n] != 0xFFFF)
+                while (k < cnt && n + k < BLOCKS &&
+                        (map[n] & 7) + k < SLOTS && map[n+k] == map[n] + k)
+                    ++k;
+            if (k > 1)
+                F::read(offset(map[n]), p, 512 * k);
+            else
+                read512(n, p);
+            n += k;
+            p += 512 * k;
+            cnt -= k;
+        }
+    }
+
+    static void writeMulti (int n, void const* buf, int cnt) {
+        for (int i = 0; i < cnt; ++i)
+            write512(n + i, (uint8_t const*) buf + 512 * i);
+    }
+
+    static void write512 (int n, void const* buf) {
+        if (n >= BLOCKS)
+            return;
+        program(claim(), n, buf);
+        // with this much room left, a reclaim can always be completed,
+        // even after a few power failures which leave unusable slots
+        while (spare() < 2 * SLOTS)
+            reclaim();
+    }
+
+    static int next (int s) { return s + 1 < SECTORS ? s + 1 : 0; }
+
+    // number of free slots, i.e. in the head plus in all unused sectors
+    static int spare () {
+        int gap = tail - head - 1;
+        if (gap < 0)
+            gap += SECTORS;
+        return SLOTS - fill + SLOTS * gap;
+    }
+
+    // allocate the next slot, moving on to a fresh sector when needed
+    static int claim () {
+        if (fill >= SLOTS) {
+            head = next(head);
+            format(head);
+            fill = 0;
+        }
+        return (head << 3) + fill++;
+    }
+
+    static uint32_t offset (int slot) {
+        return (FIRST + (slot >> 3)) * 4096 + 512 * ((slot & 7) + 1);
+    }
+
+    static uint32_t base (int s) { return (FIRST + s) * 4096; }
+
+    static bool header (int s, Header& h) {
+        F::read(base(s), &h, sizeof h);
+        return h.magic == MAGIC && h.seq == ~h.seqInv;
+    }
+
+    static void format (int s) {
+        Header h;
+        header(s, h);
+        uint32_t n = h.magic == MAGIC ? h.erases + 1 : 1;
+        F::erase((FIRST + s) * 16);
+        memset(&h, 0xFF, sizeof h);
+        h.magic = MAGIC;
+        h.seq = ++seq;
+        h.seqInv = ~seq;
+        h.erases = n;
+        F::write(base(s), &h, 16);
+    }
+
+    static void program (int slot, uint16_t n, void const* buf) {
+        uint32_t hdr = base(slot >> 3), pos = offset(slot);
+        uint16_t zero = 0;
+        F::write(hdr + 16 + 2 * (slot & 7), &n, 2);
+        F::write(pos, buf, 512);
+        F::write(hdr + 16 + 2 * (SLOTS + (slot & 7)), &zero, 2);
+        map[n] = slot;
+    }
+
+    // move the live blocks out of the tail sector and retire it
+    static void reclaim () {
+        Header h;
+        header(tail, h);
+        for (int i = 0; i < SLOTS; ++i) {
+            uint16_t n = h.tag[i];
+            if (n < BLOCKS && map[n] == (tail << 3) + i) {
+                F::read(offset(map[n]), buf, 512);
+                program(claim(), n, buf);
+            }
+        }
+        uint32_t zero = 0;
+        F::write(base(tail) + 8, &zero, 4);  // clear seqInv, sector is unused
+        tail = next(tail);
+    }
+
+    static uint16_t map [BLOCKS];   // block -> sector*8 + slot, or 0xFFFF
+    static uint32_t seq;            // sequence number of the head sector
+    static uint16_t head, tail;     // newest and oldest sector in use
+    static uint8_t fill;            // number of slots used in the head
+    static uint8_t buf [512];       // used while reclaiming
 };
+
+template< typename F, int SECTORS, int BLOCKS, int FIRST >
+uint16_t FlashFTL<F,SECTORS,BLOCKS,FIRST>::map [BLOCKS];
+template< typename F, int SECTORS, int BLOCKS, int FIRST >
+uint32_t FlashFTL<F,SECTORS,BLOCKS,FIRST>::seq;
+template< typename F, int SECTORS, int BLOCKS, int FIRST >
+uint16_t FlashFTL<F,SECTORS,BLOCKS,FIRST>::head;
+template< typename F, int SECTORS, int BLOCKS, int FIRST >
+uint16_t FlashFTL<F,SECTORS,BLOCKS,FIRST>::tail;
+template< typename F, int SECTORS, int BLOCKS, int FIRST >
+uint8_t FlashFTL<F,SECTORS,BLOCKS,FIRST>::fill;
+template< typename F, int SECTORS, int BLOCKS, int FIRST >
+uint8_t FlashFTL<F,SECTORS,BLOCKS,FIRST>::buf [512];
+
+// Key-value store for small settings, as a log of CRC-protected records in
+// a few flash sectors. Updates are appended, so they only cost a few page
+// programs. The location of each key's latest record is kept in RAM, and
+// rebuilt by scanning all sectors in init(). When the log is about to wrap,
+// the live records in its oldest sector get copied to the head, as in the
+// FlashFTL above. Keys are 0..KEYS-1, values are 0..255 bytes, removing
+// a key appends a 0-byte record. The live records, 5 bytes plus the value
+// each, may take up to ROOM bytes in all, put() returns false beyond that.
+//
+// Sector layout: 16-byte header, then records: key (2), len (1), crc (2),
+// and data. The header goes out first, a torn record fails its crc check
+// and is skipped, using its length byte if its data was being written.
+
+template< typename F, int SECTORS, int KEYS, int FIRST =0 >
+struct FlashKV {
+    constexpr static uint32_t MAGIC = 0x564B4635;  // "5FKV"
+    constexpr static int SIZE = 4096;
+    constexpr static int HDR = 16;
+    // records don't span sectors, so up to one record's worth can't be used
+    constexpr static int ROOM = (SECTORS - 3) * (SIZE - HDR - (5+255));
+    static_assert(SECTORS >= 4, "need at least 4 sectors");
+
+    static void init () {
+        for (int i = 0; i < KEYS; ++i)
+            index[i] = 0;
+
+        int newest = -1;
+        for (int s = 0; s < SECTORS; ++s)
+            if (valid(s) && (newest < 0 || (int32_t) (hdr[1] - seq) > 0)) {
+                newest = s;
+                seq = hdr[1];
+            }
+        if (newest < 0) {  // empty flash
+            head = tail = seq = 0;
+            format(head);
+            fill = HDR;
+            return;
+        }
+        head = newest;
+
+        // replay from oldest to newest, later records override earlier ones
+        tail = next(head);
+        while (!valid(tail))
+            tail = next(tail);
+        for (int s = tail; ; s = next(s)) {
+            if (valid(s)) {
+                int pos = HDR;
+                while (pos + 5 <= SIZE) {
+                    int n = record(base(s) + pos);
+                    if (n == 0)
+                        break;
+                    uint16_t key = buf[0] | buf[1] << 8;
+                    if (n > 0 && key < KEYS)
+                        index[key] = n > 5 ? base(s) + pos : 0;
+                    pos += n > 0 ? n : -n;  // also skip over a torn record
+                }
+                fill = pos < SIZE ? pos : SIZE;
+            }
+            if (s == head)
+                break;
+        }
+
+        live = 0;
+        for (int i = 0; i < KEYS; ++i)
+            if (index[i] != 0)
+                live += size(index[i]);
+
+        while (spare() < 2 * SIZE)
+            reclaim();
+    }
+
+    // copy the value to ptr, return its length, or -1 if the key is not set
+    static int get (int key, void* ptr, int len) {
+        if (key >= KEYS || index[key] == 0)
+            return -1;
+        int n = record(index[key]) - 5;
+        if (n < 0)
+            return -1;  // damaged record
+        memcpy(ptr, buf + 5, n < len ? n : len);
+        return n;
+    }
+
+    // returns false if the key or length is invalid, or there is no room
+    static bool put (int key, void const* ptr, int len) {
+        if (key >= KEYS || len > 255)
+            return false;
+        int now = len > 0 ? 5 + len : 0;
+        int old = index[key] != 0 ? size(index[key]) : 0;
+        if (live - old + now > ROOM)
+            return false;
+        live += now - old;
+        append(key, ptr, len);
+        while (spare() < 2 * SIZE)
+            reclaim();
+        return true;
+    }
+
+    static bool remove (int key) {
+        return put(key, 0, 0);
+    }
+
+    static int next (int s) { return s + 1 < SECTORS ? s + 1 : 0; }
+
+    static uint32_t base (int s) { return (FIRST + s) * SIZE; }
+
+    // number of free bytes, i.e. in the head plus in all unused sectors
+    static int spare () {
+        int gap = tail - head - 1;
+        if (gap < 0)
+            gap += SECTORS;
+        return SIZE - fill + SIZE * gap;
+    }
+
+    static bool valid (int s) {
+        F::read(base(s), hdr, sizeof hdr);
+        return hdr[0] == MAGIC && hdr[1] == ~hdr[2];
+    }
+
+    static void format (int s) {
+        F::erase((FIRST + s) * 16);
+        hdr[0] = MAGIC;
+        hdr[1] = ++seq;
+        hdr[2] = ~seq;
+        hdr[3] = ~0;
+        F::write(base(s), hdr, sizeof hdr);
+    }
+
+    // size of a record, also when damaged
+    static int size (uint32_t addr) {
+        uint8_t len;
+        F::read(addr + 2, &len, 1);
+        return 5 + len;
+    }
+
+    // read a record into buf, return its size, 0 if blank, < 0 if damaged
+    static int record (uint32_t addr) {
+        F::read(addr, buf, 5);
+        if ((buf[0] & buf[1] & buf[2] & buf[3] & buf[4]) == 0xFF)
+            return 0;
+        int n = 5 + buf[2];
+        if (addr % SIZE + n > SIZE)
+            return -SIZE;
+        F::read(addr + 5, buf + 5, buf[2]);
+        uint16_t crc = CRC16::calculate(buf, 3);
+        crc = CRC16::calculate(buf + 5, buf[2], crc);
+        return crc == (buf[3] | buf[4] << 8) ? n : -n;
+    }
+
+    static void append (uint16_t key, void const* ptr, int len) {
+        if (fill + 5 + len > SIZE) {
+            head = next(head);
+            format(head);
+            fill = HDR;
+        }
+        uint8_t h [5] = { (uint8_t) key, (uint8_t) (key >> 8), (uint8_t) len };
+        uint16_t crc = CRC16::calculate(h, 3);
+        crc = CRC16::calculate(ptr, len, crc);
+        h[3] = crc;
+        h[4] = crc >> 8;
+        uint32_t addr = base(head) + fill;
+        F::write(addr, h, 5);
+        F::write(addr + 5, ptr, len);
+        fill += 5 + len;
+        index[key] = len > 0 ? addr : 0;
+    }
+
+    // move the live records out of the tail sector and retire it
+    static void reclaim () {
+        int pos = HDR;
+        while (pos + 5 <= SIZE) {
+            uint32_t addr = base(tail) + pos;
+            int n = record(addr);
+            if (n == 0)
+                break;
+            if (n < 0) {
+                pos -= n;
+                continue;
+            }
+            uint16_t key = buf[0] | buf[1] << 8;
+            if (key < KEYS && index[key] == addr) {
+                uint8_t tmp [255];
+                memcpy(tmp, buf + 5, n - 5);
+                append(key, tmp, n - 5);
+            }
+            pos += n;
+        }
+        uint32_t zero = 0;
+        F::write(base(tail) + 8, &zero, 4);  // clear seqInv, sector is unused
+        tail = next(tail);
+    }
+
+    static uint32_t index [KEYS];   // flash address of each key, or 0
+    static uint32_t seq;            // sequence number of the head sector
+    static uint32_t hdr [4];        // sector header: magic, seq, ~seq
+    static uint16_t head, tail;     // newest and oldest sector in use
+    static uint16_t fill;           // bytes used in the head sector
+    static int live;                // bytes used by all live records
+    static uint8_t buf [5+255];     // last record read
+};
+
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint32_t FlashKV<F,SECTORS,KEYS,FIRST>::index [KEYS];
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint32_t FlashKV<F,SECTORS,KEYS,FIRST>::seq;
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint32_t FlashKV<F,SECTORS,KEYS,FIRST>::hdr [4];
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint16_t FlashKV<F,SECTORS,KEYS,FIRST>::head;
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint16_t FlashKV<F,SECTORS,KEYS,FIRST>::tail;
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint16_t FlashKV<F,SECTORS,KEYS,FIRST>::fill;
+template< typename F, int SECTORS, int KEYS, int FIRST >
+int FlashKV<F,SECTORS,KEYS,FIRST>::live;
+template< typename F, int SECTORS, int KEYS, int FIRST >
+uint8_t FlashKV<F,SECTORS,KEYS,FIRST>::buf [5+255];
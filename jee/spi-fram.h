@@ -1,6 +1,8 @@
 // Driver for Fujitsu MB85RS2MTA spi fram memory
 // see https://jeelabs.org/ref/MB85RS2MTA.pdf
 
+#include "util-crc.h"
+
 template< typename SPI >
 struct Fram {
     static void init () {
@@ -32,7 +34,19 @@ struct Fram {
 		SPI::disable();
 	}
 
+	static void read256 (int page, void* buf) {
+		read(page<<8, (uint8_t*) buf, 256);
+	}
+
+	static void write256 (int page, void const* buf) {
+		write(page<<8, (uint8_t const*) buf, 256);
+	}
+
+	// the write enable latch is cleared after each write, so set it again
 	static void write (uint32_t addr, uint8_t const* buf, int len) {
+		SPI::enable();
+		SPI::transfer(0x06);  // write enable
+		SPI::disable();
 		SPI::enable();
 		SPI::transfer(0x02);  // write
 		SPI::transfer(addr >> 16);
@@ -43,3 +57,260 @@ struct Fram {
 		SPI::disable();
 	}
 };
+
+// Ring-buffer logger in fram, for variable-length records of up to 255 bytes.
+// Each record has a length, a sequence number, and a header crc, followed by
+// the data and a data crc. Records are collected in RAM and written out in
+// batches, after which a superblock with the head and tail is updated. Two
+// copies are used for the superblock, so a torn write will not lose both.
+// On init, records written after the last superblock update are recovered,
+// as well as the tail if the oldest records were partially overwritten.
+
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH =512 >
+struct FramLog {
+    constexpr static uint32_t MAGIC = 0x474F4C46;  // "FLOG"
+    constexpr static uint32_t DATA = BASE + 64, RING = SIZE - 64;
+    constexpr static int HDR = 7, MAXREC = HDR + 255 + 2;
+
+    static_assert(BATCH >= MAXREC, "batch must hold the largest record");
+    static_assert(RING > BATCH, "ring must be larger than the batch");
+
+    struct Super {
+        uint32_t magic, gen, head, tail, headSeq, tailSeq;
+        uint16_t pad, crc;
+    };
+
+    // returns false if there was no valid log, and a new one was started
+    static bool init () {
+        Super s [2];
+        F::read(BASE, (uint8_t*) &s[0], sizeof s[0]);
+        F::read(BASE + 32, (uint8_t*) &s[1], sizeof s[1]);
+        bool ok [2] = { check(s[0]), check(s[1]) };
+        if (!ok[0] && !ok[1]) {
+            gen = head = tail = headSeq = tailSeq = 0;
+            fill = 0;
+            save();
+            return false;
+        }
+        Super& t = ok[0] && (!ok[1] || (int32_t) (s[0].gen - s[1].gen) > 0) ?
+                    s[0] : s[1];
+        gen = t.gen;
+        head = t.head;
+        tail = t.tail;
+        headSeq = t.headSeq;
+        tailSeq = t.tailSeq;
+        fill = 0;
+
+        // roll forward over records written after the last superblock update
+        uint32_t oldHead = head, oldSeq = headSeq;
+        int n;
+        while ((n = valid(head, headSeq, headSeq)) >= 0) {
+            head = wrap(head + n);
+            ++headSeq;
+        }
+        // these may have overwritten the oldest records, if so the first
+        // intact one after them becomes the new tail
+        bool changed = headSeq != oldSeq;
+        if ((int32_t) (tailSeq - oldSeq) < 0 && valid(tail, tailSeq, tailSeq) < 0) {
+            uint32_t seq, gap = head >= oldHead ? head - oldHead :
+                                                  head + RING - oldHead;
+            int32_t p = resync(head, RING - gap, tailSeq + 1, oldSeq - 1, seq);
+            tail = p >= 0 ? p : oldHead;
+            tailSeq = p >= 0 ? seq : oldSeq;
+            changed = true;
+        }
+        if (changed)
+            save();
+        cursor = tail;
+        cursorSeq = tailSeq;
+        return true;
+    }
+
+    // add a record to the batch, which is written out once it fills up
+    static bool append (void const* ptr, int len) {
+        if (len < 0 || len > 255)
+            return false;
+        if (fill + HDR + len + 2 > BATCH)
+            flush();
+        uint32_t seq = headSeq + pending;
+        uint8_t* p = batch + fill;
+        p[0] = len;
+        for (int i = 0; i < 4; ++i)
+            p[1+i] = seq >> (8*i);
+        put16(p + 5, CRC16::calculate(p, 5));
+        for (int i = 0; i < len; ++i)
+            p[HDR+i] = ((uint8_t const*) ptr)[i];
+        put16(p + HDR + len, CRC16::calculate(p + HDR, len));
+        fill += HDR + len + 2;
+        ++pending;
+        return true;
+    }
+
+    // write the batch, dropping the oldest records to make room as needed
+    static void flush () {
+        if (fill == 0)
+            return;
+        while (used() + fill >= RING) {
+            uint8_t h [HDR];
+            readRing(tail, h, HDR);
+            tail = wrap(tail + HDR + h[0] + 2);
+            ++tailSeq;
+        }
+        writeRing(head, batch, fill);
+        head = wrap(head + fill);
+        headSeq += pending;
+        fill = pending = 0;
+        save();
+    }
+
+    // read the record with the given sequence number, returns its length,
+    // or -1 if it is no longer (or not yet) in the log
+    static int read (uint32_t seq, void* buf, int max) {
+        flush();
+        // sequence numbers wrap, so only compare their differences
+        if ((int32_t) (seq - tailSeq) < 0 || (int32_t) (seq - headSeq) >= 0)
+            return -1;
+        if (seq != cursorSeq)
+            seek(seq);
+        int n = valid(cursor, seq, seq);
+        if (n < 0)
+            return -1;
+        int len = n - HDR - 2;
+        readRing(cursor + HDR, (uint8_t*) buf, len < max ? len : max);
+        cursor = wrap(cursor + n);
+        cursorSeq = seq + 1;
+        return len;
+    }
+
+    // sequence numbers of the oldest record and of the next one to be added
+    static uint32_t first () { return tailSeq; }
+    static uint32_t next () { return headSeq + pending; }
+
+    static uint32_t used () {
+        return head >= tail ? head - tail : head + RING - tail;
+    }
+
+    static uint32_t wrap (uint32_t pos) {
+        return pos >= RING ? pos - RING : pos;
+    }
+
+    static void readRing (uint32_t pos, uint8_t* buf, int len) {
+        pos = wrap(pos);
+        int n = RING - pos < (uint32_t) len ? RING - pos : len;
+        F::read(DATA + pos, buf, n);
+        if (n < len)
+            F::read(DATA, buf + n, len - n);
+    }
+
+    static void writeRing (uint32_t pos, uint8_t const* buf, int len) {
+        int n = RING - pos < (uint32_t) len ? RING - pos : len;
+        F::write(DATA + pos, buf, n);
+        if (n < len)
+            F::write(DATA, buf + n, len - n);
+    }
+
+    static void put16 (uint8_t* p, uint16_t v) {
+        p[0] = v;
+        p[1] = v >> 8;
+    }
+
+    // check the record at pos, returns its total size or -1 if not valid
+    static int valid (uint32_t pos, uint32_t lo, uint32_t hi) {
+        uint8_t h [HDR];
+        readRing(pos, h, HDR);
+        uint32_t seq = h[1] | (h[2]<<8) | (h[3]<<16) | ((uint32_t) h[4]<<24);
+        if ((h[5] | (h[6]<<8)) != CRC16::calculate(h, 5) ||
+                (int32_t) (seq - lo) < 0 || (int32_t) (hi - seq) < 0)
+            return -1;
+        uint8_t d [257];
+        readRing(pos + HDR, d, h[0] + 2);
+        if ((d[h[0]] | (d[h[0]+1]<<8)) != CRC16::calculate(d, h[0]))
+            return -1;
+        return HDR + h[0] + 2;
+    }
+
+    // find the first valid record in the next len bytes from pos, with a
+    // sequence number in the lo..hi range, returns -1 if there is none
+    static int32_t resync (uint32_t pos, uint32_t len,
+                            uint32_t lo, uint32_t hi, uint32_t& seq) {
+        for (; len > 0; --len) {
+            if (valid(pos, lo, hi) >= 0) {
+                uint8_t h [HDR];
+                readRing(pos, h, HDR);
+                seq = h[1] | (h[2]<<8) | (h[3]<<16) | ((uint32_t) h[4]<<24);
+                return pos;
+            }
+            pos = wrap(pos + 1);
+        }
+        return -1;
+    }
+
+    // binary search for a record, then step forward to it
+    static void seek (uint32_t seq) {
+        uint32_t lo = tail, loSeq = tailSeq, span = used();
+        while (span > 2 * MAXREC) {
+            uint32_t mid = wrap(lo + span / 2), s;
+            int32_t p = resync(mid, MAXREC, loSeq, headSeq - 1, s);
+            if (p >= 0 && (int32_t) (s - seq) <= 0) {
+                span -= (uint32_t) p >= lo ? p - lo : p + RING - lo;
+                lo = p;
+                loSeq = s;
+            } else
+                span = span / 2;
+        }
+        while ((int32_t) (loSeq - seq) < 0) {
+            uint8_t h [HDR];
+            readRing(lo, h, HDR);
+            lo = wrap(lo + HDR + h[0] + 2);
+            ++loSeq;
+        }
+        cursor = lo;
+        cursorSeq = loSeq;
+    }
+
+    static bool check (Super const& s) {
+        return s.magic == MAGIC &&
+                s.crc == CRC16::calculate(&s, sizeof s - 2) &&
+                s.head < RING && s.tail < RING;
+    }
+
+    // write the superblock, alternating between both copies
+    static void save () {
+        Super s;
+        s.magic = MAGIC;
+        s.gen = ++gen;
+        s.head = head;
+        s.tail = tail;
+        s.headSeq = headSeq;
+        s.tailSeq = tailSeq;
+        s.pad = 0;
+        s.crc = CRC16::calculate(&s, sizeof s - 2);
+        F::write(BASE + 32 * (gen & 1), (uint8_t const*) &s, sizeof s);
+    }
+
+    static uint32_t gen, head, tail, headSeq, tailSeq;
+    static uint32_t cursor, cursorSeq;  // next record for sequential reads
+    static uint16_t fill, pending;
+    static uint8_t batch [BATCH];
+};
+
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::gen;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::head;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::tail;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::headSeq;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::tailSeq;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::cursor;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint32_t FramLog<F,BASE,SIZE,BATCH>::cursorSeq;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint16_t FramLog<F,BASE,SIZE,BATCH>::fill;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint16_t FramLog<F,BASE,SIZE,BATCH>::pending;
+template< typename F, uint32_t BASE, uint32_t SIZE, int BATCH >
+uint8_t FramLog<F,BASE,SIZE,BATCH>::batch [BATCH];
@@ -14,7 +14,7 @@
 
 template< typename SPI >
 struct RF69 {
-    void init (uint8_t id, uint8_t group, int freq);
+    void init (uint8_t id, uint8_t group, int freq, const uint8_t* modem =0);
     void encrypt (const char* key);
     void txPower (uint8_t level);
 
@@ -28,12 +28,22 @@ struct RF69 {
     uint8_t myId;
     uint8_t parity;
 
+    // config registers are shadowed in ram, reads only go out when needed
     uint8_t readReg (uint8_t addr) {
-        return rwReg(addr, 0);
+        if (!cacheable(addr))
+            return rwReg(addr, 0);
+        if (!isValid(addr)) {
+            shadow[addr] = rwReg(addr, 0);
+            valid[addr>>3] |= 1 << (addr & 7);
+        }
+        return shadow[addr];
     }
     void writeReg (uint8_t addr, uint8_t val) {
         rwReg(addr | 0x80, val);
+        remember(addr, val);
     }
+    void writeRegs (uint8_t addr, const uint8_t* p, int n);
+    static void readRegs (uint8_t addr, uint8_t* p, int n);
     // TODO somewhat redundant to have readReg, writeReg, and rwReg ...
     static uint8_t rwReg (uint8_t cmd, uint8_t val) {
         SPI::enable();
@@ -54,12 +64,16 @@ struct RF69 {
         REG_FEIMSB        = 0x21,
         REG_FEILSB        = 0x22,
         REG_RSSIVALUE     = 0x24,
+        REG_DIOMAPPING1   = 0x25,
         REG_IRQFLAGS1     = 0x27,
         REG_IRQFLAGS2     = 0x28,
+        REG_RSSITHRESH    = 0x29,
         REG_SYNCVALUE1    = 0x2F,
         REG_SYNCVALUE2    = 0x30,
         REG_NODEADDR      = 0x39,
         REG_BCASTADDR     = 0x3A,
+        REG_PKTCONFIG1    = 0x37,
+        REG_PAYLOADLEN    = 0x38,
         REG_FIFOTHRESH    = 0x3C,
         REG_PKTCONFIG2    = 0x3D,
         REG_AESKEYMSB     = 0x3E,
@@ -75,18 +89,51 @@ struct RF69 {
         RCCALSTART        = 0x80,
         IRQ1_MODEREADY    = 1<<7,
         IRQ1_RXREADY      = 1<<6,
+        IRQ1_PLLLOCK      = 1<<4,
         IRQ1_SYNADDRMATCH = 1<<0,
 
         IRQ2_FIFONOTEMPTY = 1<<6,
+        IRQ2_FIFOLEVEL    = 1<<5,
+        IRQ2_FIFOOVERRUN  = 1<<4,
         IRQ2_PACKETSENT   = 1<<3,
         IRQ2_PAYLOADREADY = 1<<2,
+        IRQ2_CRCOK        = 1<<1,
+
+        DIO0_PACKETSENT   = 0<<6,  // in transmit mode
+        DIO0_PAYLOADREADY = 1<<6,  // in receive mode
+        DIO0_SYNCADDR     = 2<<6,  // in receive mode
     };
 
     void setMode (uint8_t newMode);
     void configure (const uint8_t* p);
     void setFrequency (uint32_t freq);
 
+    // status, fifo, and measurement registers change by themselves
+    static bool cacheable (uint8_t a) {
+        return 0 < a && a < sizeof shadow && a != 0x0A && a != 0x18 &&
+                (a < 0x1E || a > 0x24) && a != 0x27 && a != 0x28;
+    }
+    bool isValid (uint8_t a) const {
+        return (valid[a>>3] >> (a & 7)) & 1;
+    }
+    void remember (uint8_t a, uint8_t v) {
+        if (cacheable(a)) {
+            shadow[a] = v;
+            valid[a>>3] |= 1 << (a & 7);
+        }
+    }
+
+    void readMeta (uint8_t& rssi, uint8_t& lna, int16_t& afc);
+    int readFifo (void* ptr, int len);
+    void writeFifo (uint8_t header, const void* ptr, int len);
+    void readBytes (uint8_t* ptr, int n, int keep);
+    void writeBytes (const uint8_t* ptr, int n);
+    bool accept (uint8_t dest) const;
+    uint32_t airtime (int len);
+
     uint8_t mode;
+    uint8_t shadow [0x4E];  // up to, but not including the temperature regs
+    uint8_t valid [(sizeof shadow + 7) / 8];
 };
 
 // driver implementation
@@ -112,19 +159,44 @@ void RF69<SPI>::setFrequency (uint32_t hz) {
     // this is still 4 ppm, i.e. well below the radio's 32 MHz crystal accuracy
     // 868.0 MHz = 0xD90000, 868.3 MHz = 0xD91300, 915.0 MHz = 0xE4C000
     uint32_t frf = (hz << 2) / (32000000L >> 11);
-    writeReg(REG_FRFMSB, frf >> 10);
-    writeReg(REG_FRFMSB+1, frf >> 2);
-    writeReg(REG_FRFMSB+2, frf << 6);
+    uint8_t buf [] = { (uint8_t) (frf >> 10), (uint8_t) (frf >> 2),
+                       (uint8_t) (frf << 6) };
+    writeRegs(REG_FRFMSB, buf, sizeof buf);
+}
+
+// write n consecutive registers in one transfer, the radio auto-increments
+template< typename SPI >
+void RF69<SPI>::writeRegs (uint8_t addr, const uint8_t* p, int n) {
+    SPI::enable();
+    SPI::transfer(addr | 0x80);
+    for (int i = 0; i < n; ++i) {
+        SPI::transfer(p[i]);
+        remember(addr + i, p[i]);
+    }
+    SPI::disable();
 }
 
+// read n consecutive registers in one transfer, bypassing the shadow copies
+template< typename SPI >
+void RF69<SPI>::readRegs (uint8_t addr, uint8_t* p, int n) {
+    SPI::enable();
+    SPI::transfer(addr);
+    for (int i = 0; i < n; ++i)
+        p[i] = SPI::transfer(0);
+    SPI::disable();
+}
+
+// runs of consecutive register addresses are sent as a single burst
 template< typename SPI >
 void RF69<SPI>::configure (const uint8_t* p) {
-    while (true) {
-        uint8_t cmd = p[0];
-        if (cmd == 0)
-            break;
-        writeReg(cmd, p[1]);
-        p += 2;
+    while (p[0] != 0) {
+        uint8_t first = p[0], buf [16];
+        int n = 0;
+        do {
+            buf[n++] = p[1];
+            p += 2;
+        } while (n < (int) sizeof buf && p[0] == first + n);
+        writeRegs(first, buf, n);
     }
 }
 
@@ -154,22 +226,78 @@ static const uint8_t configRegs [] = {
     0
 };
 
+// Modem settings, derived at compile time from the bit rate and deviation:
+// the receiver bandwidth covers fdev + bps/2 plus 20 kHz for crystal offsets,
+// the afc bandwidth is one step wider, and the preamble is 2 bytes plus the
+// ~400 us needed for agc and afc to settle. Pass regs as last arg to init().
+// RF69Modem49k reproduces the defaults in configRegs.
+
+template< uint32_t BPS, uint32_t FDEV, bool GAUSS =false >
+struct RF69Modem {
+    static_assert(FDEV + BPS/2 <= 500000, "fdev + bps/2 must be <= 500 kHz");
+    static_assert(2*FDEV >= BPS/2, "modulation index must be at least 0.5");
+
+    // receiver bandwidth codes in increasing order: exp 7..0, mant 24, 20, 16
+    constexpr static uint8_t bwCode (uint32_t hz, int i =0) {
+        return i == 23 || 32000000U / ((24-4*(i%3)) << (7-i/3+2)) >= hz ?
+            0x40 | (2-i%3) << 3 | (7-i/3) :  // DccFreq = 4% of rxbw
+            bwCode(hz, i+1);
+    }
+
+    constexpr static uint16_t divider = (32000000 + BPS/2) / BPS;
+    constexpr static uint16_t fdev = (FDEV * 524288ULL + 16000000) / 32000000;
+    constexpr static uint32_t rxBw = FDEV + BPS/2 + 20000;
+    constexpr static uint8_t preamble = 2 + (BPS * 400ULL + 7999999) / 8000000;
+
+    constexpr static uint8_t regs [] = {
+        0x02, GAUSS ? 0x02 : 0x00, // DataModul = packet mode, fsk, BT 0.5
+        0x03, divider >> 8,        // BitRateMsb
+        0x04, divider & 0xFF,      // BitRateLsb
+        0x05, fdev >> 8,           // FdevMsb
+        0x06, fdev & 0xFF,         // FdevLsb
+        0x19, bwCode(rxBw),        // RxBw
+        0x1A, bwCode(rxBw*5/4),    // AfcBw
+        0x2C, 0x00,                // PreambleMsb
+        0x2D, preamble,            // PreambleLsb
+        0
+    };
+
+    // time on air in us of a packet with len bytes of payload, as in send()
+    // preamble, sync (2), length, dest, src, payload, crc (2)
+    constexpr static uint32_t airtime (int len) {
+        return (preamble + 2 + 3 + len + 2) * 8000000ULL / BPS;
+    }
+};
+
+template< uint32_t BPS, uint32_t FDEV, bool GAUSS >
+constexpr uint8_t RF69Modem<BPS,FDEV,GAUSS>::regs [];
+
+typedef RF69Modem<  4800,   5000       > RF69Modem4k8;   // long range
+typedef RF69Modem< 49231,  45000       > RF69Modem49k;   // default
+typedef RF69Modem<100000,  50000       > RF69Modem100k;
+typedef RF69Modem<250000, 125000, true > RF69Modem250k;  // gfsk
+
 template< typename SPI >
-void RF69<SPI>::init (uint8_t id, uint8_t group, int freq) {
+void RF69<SPI>::init (uint8_t id, uint8_t group, int freq, const uint8_t* modem) {
     myId = id;
+    for (auto& v : valid)
+        v = 0;
 
     // b7 = group b7^b5^b3^b1, b6 = group b6^b4^b2^b0
     parity = group ^ (group << 4);
     parity = (parity ^ (parity << 2)) & 0xC0;
 
+    // these reads must go to the radio, not to the shadow registers
     do
         writeReg(REG_SYNCVALUE1, 0xAA);
-    while (readReg(REG_SYNCVALUE1) != 0xAA);
+    while (rwReg(REG_SYNCVALUE1, 0) != 0xAA);
     do
         writeReg(REG_SYNCVALUE1, 0x55);
-    while (readReg(REG_SYNCVALUE1) != 0x55);
+    while (rwReg(REG_SYNCVALUE1, 0) != 0x55);
 
     configure(configRegs);
+    if (modem)
+        configure(modem);
     setFrequency(freq);
 
     writeReg(REG_SYNCVALUE2, group);
@@ -199,6 +327,67 @@ void RF69<SPI>::sleep () {
     setMode(MODE_SLEEP);
 }
 
+template< typename SPI >
+void RF69<SPI>::readMeta (uint8_t& rssi, uint8_t& lna, int16_t& afc) {
+    rssi = readReg(REG_RSSIVALUE);
+    lna = (readReg(REG_LNAVALUE) >> 3) & 0x7;
+#if RF69_SPI_BULK
+    SPI::enable();
+    SPI::transfer(REG_AFCMSB);
+    afc = SPI::transfer(0) << 8;
+    afc |= SPI::transfer(0);
+    SPI::disable();
+#else
+    afc = readReg(REG_AFCMSB) << 8;
+    afc |= readReg(REG_AFCLSB);
+#endif
+}
+
+// empty the fifo, keeping at most len bytes, returns the packet length
+template< typename SPI >
+int RF69<SPI>::readFifo (void* ptr, int len) {
+#if RF69_SPI_BULK
+    SPI::enable();
+    SPI::transfer(REG_FIFO);
+    int count = SPI::transfer(0);
+    for (int i = 0; i < count; ++i) {
+        uint8_t v = SPI::transfer(0);
+        if (i < len)
+            ((uint8_t*) ptr)[i] = v;
+    }
+    SPI::disable();
+#else
+    int count = readReg(REG_FIFO);
+    for (int i = 0; i < count; ++i) {
+        uint8_t v = readReg(REG_FIFO);
+        if (i < len)
+            ((uint8_t*) ptr)[i] = v;
+    }
+#endif
+    return count;
+}
+
+// only accept packets intended for us, or broadcasts
+// ... or any packet if we're the special catch-all node
+template< typename SPI >
+bool RF69<SPI>::accept (uint8_t dest) const {
+    if ((dest & 0xC0) != parity)
+        return false;
+    uint8_t destId = dest & 0x3F;
+    return destId == myId || destId == 0 || myId == 63;
+}
+
+// time on air in us for a packet with len bytes of payload, as in send(),
+// based on the current bit rate, preamble, and sync word settings
+template< typename SPI >
+uint32_t RF69<SPI>::airtime (int len) {
+    uint32_t divider = (readReg(0x03) << 8) | readReg(0x04);
+    int bytes = (readReg(0x2C) << 8) + readReg(0x2D) +     // preamble
+                ((readReg(0x2E) >> 3) & 7) + 1 +           // sync
+                3 + len + 2;                               // packet and crc
+    return (bytes * divider) >> 2;  // 8 bits of divider/32 us each
+}
+
 template< typename SPI >
 int RF69<SPI>::receive (void* ptr, int len) {
     if (mode != MODE_RECEIVE)
@@ -207,60 +396,22 @@ int RF69<SPI>::receive (void* ptr, int len) {
         static uint8_t lastFlag;
         if ((readReg(REG_IRQFLAGS1) & IRQ1_RXREADY) != lastFlag) {
             lastFlag ^= IRQ1_RXREADY;
-            if (lastFlag) { // flag just went from 0 to 1
-                rssi = readReg(REG_RSSIVALUE);
-                lna = (readReg(REG_LNAVALUE) >> 3) & 0x7;
-#if RF69_SPI_BULK
-                SPI::enable();
-                SPI::transfer(REG_AFCMSB);
-                afc = SPI::transfer(0) << 8;
-                afc |= SPI::transfer(0);
-                SPI::disable();
-#else
-                afc = readReg(REG_AFCMSB) << 8;
-                afc |= readReg(REG_AFCLSB);
-#endif
-            }
+            if (lastFlag) // flag just went from 0 to 1
+                readMeta(rssi, lna, afc);
         }
 
         if (readReg(REG_IRQFLAGS2) & IRQ2_PAYLOADREADY) {
-
-#if RF69_SPI_BULK
-            SPI::enable();
-            SPI::transfer(REG_FIFO);
-            int count = SPI::transfer(0);
-            for (int i = 0; i < count; ++i) {
-                uint8_t v = SPI::transfer(0);
-                if (i < len)
-                    ((uint8_t*) ptr)[i] = v;
-            }
-            SPI::disable();
-#else
-            int count = readReg(REG_FIFO);
-            for (int i = 0; i < count; ++i) {
-                uint8_t v = readReg(REG_FIFO);
-                if (i < len)
-                    ((uint8_t*) ptr)[i] = v;
-            }
-#endif
-
-            // only accept packets intended for us, or broadcasts
-            // ... or any packet if we're the special catch-all node
-            uint8_t dest = *(uint8_t*) ptr;
-            if ((dest & 0xC0) == parity) {
-                uint8_t destId = dest & 0x3F;
-                if (destId == myId || destId == 0 || myId == 63)
-                    return count;
-            }
+            int count = readFifo(ptr, len);
+            if (accept(*(uint8_t*) ptr))
+                return count;
         }
     }
     return -1;
 }
 
+// fill the fifo with a packet: length, dest + parity, src + flags, payload
 template< typename SPI >
-void RF69<SPI>::send (uint8_t header, const void* ptr, int len) {
-    setMode(MODE_SLEEP);
-
+void RF69<SPI>::writeFifo (uint8_t header, const void* ptr, int len) {
 #if RF69_SPI_BULK
     SPI::enable();
     SPI::transfer(REG_FIFO | 0x80);
@@ -277,6 +428,47 @@ void RF69<SPI>::send (uint8_t header, const void* ptr, int len) {
     for (int i = 0; i < len; ++i)
         writeReg(REG_FIFO, ((const uint8_t*) ptr)[i]);
 #endif
+}
+
+// read n bytes from the fifo, keeping at most the first keep of them
+template< typename SPI >
+void RF69<SPI>::readBytes (uint8_t* ptr, int n, int keep) {
+#if RF69_SPI_BULK
+    SPI::enable();
+    SPI::transfer(REG_FIFO);
+    for (int i = 0; i < n; ++i) {
+        uint8_t v = SPI::transfer(0);
+        if (i < keep)
+            ptr[i] = v;
+    }
+    SPI::disable();
+#else
+    for (int i = 0; i < n; ++i) {
+        uint8_t v = readReg(REG_FIFO);
+        if (i < keep)
+            ptr[i] = v;
+    }
+#endif
+}
+
+template< typename SPI >
+void RF69<SPI>::writeBytes (const uint8_t* ptr, int n) {
+#if RF69_SPI_BULK
+    SPI::enable();
+    SPI::transfer(REG_FIFO | 0x80);
+    for (int i = 0; i < n; ++i)
+        SPI::transfer(ptr[i]);
+    SPI::disable();
+#else
+    for (int i = 0; i < n; ++i)
+        writeReg(REG_FIFO, ptr[i]);
+#endif
+}
+
+template< typename SPI >
+void RF69<SPI>::send (uint8_t header, const void* ptr, int len) {
+    setMode(MODE_SLEEP);
+    writeFifo(header, ptr, len);
 
     setMode(MODE_TRANSMIT);
     while ((readReg(REG_IRQFLAGS2) & IRQ2_PACKETSENT) == 0)
@@ -284,3 +476,571 @@ void RF69<SPI>::send (uint8_t header, const void* ptr, int len) {
 
     setMode(MODE_STANDBY);
 }
+
+// Link statistics, kept by RF69Irq with a few counter updates per packet.
+// Received packets are counted, and binned by rssi (8 dB steps) and by afc
+// (~15.6 kHz steps, centered on bin 8), both in total and per sending node.
+// Airtime is accumulated in ms for both directions, to track duty cycle.
+// dump() serialises all of it as little-endian bytes, see the code below.
+
+struct RF69Stats {
+    struct Peer {
+        uint16_t packets;
+        uint8_t rssi;   // smoothed rssi value, i.e. -2*dBm
+        int8_t afc;     // smoothed afc, in ~977 Hz steps
+    };
+
+    uint32_t packets, crcFails, drops, overruns, sent;
+    uint32_t rxMs, txMs, since;
+    uint16_t rxUs, txUs;
+    uint16_t rssiHist [16], afcHist [16];
+    Peer peers [64];
+
+    void reset () {
+        *this = RF69Stats ();
+        since = ticks;
+    }
+
+    void received (uint8_t src, uint8_t rssi, int16_t afc, uint32_t us) {
+        ++packets;
+        ++rssiHist[rssi >> 4];
+        int bin = (afc >> 8) + 8;
+        ++afcHist[bin < 0 ? 0 : bin > 15 ? 15 : bin];
+        Peer& p = peers[src & 0x3F];
+        int8_t a = afc < -128*16 ? -128 : afc > 127*16 ? 127 : afc >> 4;
+        if (p.packets++ == 0) {
+            p.rssi = rssi;
+            p.afc = a;
+        } else {
+            p.rssi += (rssi - p.rssi) / 4;
+            p.afc += (a - p.afc) / 4;
+        }
+        account(rxMs, rxUs, us);
+    }
+
+    void transmitted (uint32_t us) {
+        ++sent;
+        account(txMs, txUs, us);
+    }
+
+    static void account (uint32_t& ms, uint16_t& us, uint32_t t) {
+        t += us;
+        ms += t / 1000;
+        us = t % 1000;
+    }
+
+    // transmit duty cycle since the last reset, in units of 0.1%
+    uint32_t duty () const {
+        uint32_t elapsed = ticks - since;
+        return elapsed > 0 ? (uint64_t) txMs * 1000 / elapsed : 0;
+    }
+
+    // format: 1, #peers, packets, crcFails, drops, overruns, sent, rxMs,
+    // txMs, elapsed ms (8x u32), rssi and afc bins (32x u16), and then for
+    // each node heard: id, packets (u16), rssi, afc, i.e. 98 + 5*#peers
+    int dump (uint8_t* buf, int len) const {
+        int n = 2;
+        uint32_t v [] = {
+            packets, crcFails, drops, overruns, sent, rxMs, txMs, ticks - since
+        };
+        for (auto x : v)
+            n = put(buf, len, n, x, 4);
+        for (auto x : rssiHist)
+            n = put(buf, len, n, x, 2);
+        for (auto x : afcHist)
+            n = put(buf, len, n, x, 2);
+        int count = 0;
+        for (int i = 0; i < 64; ++i)
+            if (peers[i].packets > 0 && n + 5 <= len) {
+                n = put(buf, len, n, i, 1);
+                n = put(buf, len, n, peers[i].packets, 2);
+                n = put(buf, len, n, peers[i].rssi, 1);
+                n = put(buf, len, n, (uint8_t) peers[i].afc, 1);
+                ++count;
+            }
+        put(buf, len, 0, 1, 1);
+        put(buf, len, 1, count, 1);
+        return n < len ? n : len;
+    }
+
+    static int put (uint8_t* buf, int len, int pos, uint32_t v, int size) {
+        for (int i = 0; i < size; ++i, v >>= 8)
+            if (pos + i < len)
+                buf[pos + i] = v;
+        return pos + size;
+    }
+};
+
+// Interrupt-driven receive and transmit, for use with the radio's DIO0 pin on
+// an EXTI line. While receiving, DIO0 alternates between SyncAddress, to get
+// rssi/lna/afc as the packet starts, and PayloadReady, to drain the fifo into
+// a queue of N-1 packets. While sending, it signals PacketSent, after which
+// the radio goes straight back to receive mode.
+//
+// After listen(), call interrupt() from the pin's (rising edge) handler, and
+// call poll() often from the main loop, directly or via receive(), which has
+// the same semantics as in RF69. Outgoing packets are queued by send(), which
+// returns false if there are already NTX-1 waiting. Each one goes out from
+// poll() once no packet is coming in and the rssi is below the lbt level.
+//
+// Packets can be up to MAX bytes, excluding the length byte, i.e. at most
+// 255, with up to MAX-2 bytes of payload. Packets over 65 bytes don't fit in
+// the radio's fifo: these also need DIO1 on an EXTI line, to signal the fifo
+// level, with interruptFifo() called on both edges. The fifo is then drained
+// or refilled in chunks while the packet is on the air. Note that the AES
+// engine can't be used with packets over 65 bytes.
+//
+// Only the interrupt handlers and poll() talk to the radio. An interrupt
+// which arrives while poll() is using the SPI bus is deferred until the next
+// poll() call. Packets which arrive while the receive queue is full are
+// dropped. Packets with a bad crc are read out and discarded, so that they
+// can be counted.
+
+template< typename SPI, int N =4, int NTX =3, int MAX =65 >
+struct RF69Irq : RF69<SPI> {
+    typedef RF69<SPI> base;
+
+    static_assert(2 <= MAX && MAX <= 255, "packet size must be 2..255");
+
+    struct Packet {
+        int16_t afc;
+        uint8_t rssi;
+        uint8_t lna;
+        uint8_t len;        // excluding the length byte itself
+        uint8_t data [MAX]; // dest + parity, flags + src, payload
+    };
+
+    void listen ();
+    void interrupt ();
+    void interruptFifo ();
+    void poll ();
+
+    bool available () const { return in != out; }
+    int receive (void* ptr, int len);
+
+    bool sending () const { return txIn != txOut; }
+    bool send (uint8_t header, const void* ptr, int len);
+
+    enum { IDLE, LISTEN, INCOMING, SENDING };
+    enum { FIFO = 66, THRESH = 32 };
+
+    void service ();
+    void serviceFifo ();
+    void startRx ();
+    void startTx ();
+
+    static uint8_t next (uint8_t i, int n) { return i + 1 < n ? i + 1 : 0; }
+
+    Packet queue [N];
+    Packet txQueue [NTX];
+    uint8_t volatile in, out, txIn, txOut;
+    uint8_t volatile state;
+    bool volatile busy, deferred, deferredFifo;
+    uint16_t rxPos, txPos;  // bytes moved so far, including the length byte
+    uint8_t lbt;  // clear if rssi value >= lbt, i.e. -2*dBm, default RssiThresh
+    RF69Stats stats;
+};
+
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::listen () {
+    in = out = txIn = txOut = 0;
+    busy = deferred = deferredFifo = false;
+    stats.reset();
+    // also raise PayloadReady for bad packets, so that they can be counted
+    base::writeReg(base::REG_PKTCONFIG1, base::readReg(base::REG_PKTCONFIG1) | 0x08);
+    base::writeReg(base::REG_PAYLOADLEN, MAX);  // drop anything longer
+    base::writeReg(base::REG_FIFOTHRESH, 0x80 | THRESH);  // tx on not empty
+    if (lbt == 0)
+        lbt = base::readReg(base::REG_RSSITHRESH);
+    startRx();
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::interrupt () {
+    if (busy)
+        deferred = true;
+    else
+        service();
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::interruptFifo () {
+    if (busy)
+        deferredFifo = true;
+    else
+        serviceFifo();
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::poll () {
+    busy = true;
+    if (deferred) {
+        deferred = false;
+        service();
+    }
+    if (deferredFifo) {
+        deferredFifo = false;
+        serviceFifo();
+    }
+    // bad packets still get to PayloadReady (see listen), but the radio
+    // drops a packet without it when its length byte is over PayloadLength,
+    // e.g. when garbled, and restarts reception, which clears SyncAddress:
+    // catch that, else DIO0 misses the next sync and sending would stall
+    if (state == INCOMING && (base::readReg(base::REG_IRQFLAGS1) &
+                                base::IRQ1_SYNADDRMATCH) == 0)
+        startRx();
+    if (txIn != txOut && state == LISTEN &&
+            base::readReg(base::REG_RSSIVALUE) >= lbt)
+        startTx();
+    busy = false;
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::service () {
+    if (state == SENDING) {
+        if (base::readReg(base::REG_IRQFLAGS2) & base::IRQ2_PACKETSENT) {
+            txOut = next(txOut, NTX);
+            startRx();
+        }
+        return;
+    }
+
+    Packet& p = queue[in];  // the slot at "in" is never seen by receive()
+
+    uint8_t flags = base::readReg(base::REG_IRQFLAGS2);
+    if (flags & base::IRQ2_FIFOOVERRUN) {
+        base::writeReg(base::REG_IRQFLAGS2, base::IRQ2_FIFOOVERRUN);  // clear
+        ++stats.overruns;
+    }
+
+    if (flags & base::IRQ2_PAYLOADREADY) {
+        if (rxPos == 0)
+            p.len = base::readFifo(p.data, MAX);
+        else  // the rest of a packet which was partly read by serviceFifo
+            base::readBytes(p.data + rxPos - 1, p.len + 1 - rxPos, MAX + 1 - rxPos);
+        rxPos = 0;
+        if ((flags & base::IRQ2_CRCOK) == 0 || p.len < 2 || p.len > MAX)
+            ++stats.crcFails;
+        else {
+            stats.received(p.data[1], p.rssi, p.afc, base::airtime(p.len-2));
+            if (base::accept(p.data[0])) {
+                if (next(in, N) != out)
+                    in = next(in, N);
+                else
+                    ++stats.drops;
+            }
+        }
+        base::writeReg(base::REG_DIOMAPPING1, base::DIO0_SYNCADDR);
+        state = LISTEN;
+    } else if (base::readReg(base::REG_IRQFLAGS1) & base::IRQ1_SYNADDRMATCH) {
+        base::readMeta(p.rssi, p.lna, p.afc);
+        base::writeReg(base::REG_DIOMAPPING1, base::DIO0_PAYLOADREADY);
+        state = INCOMING;
+    }
+}
+
+// FifoLevel changed: refill the fifo while sending, or drain it while a long
+// packet is coming in, and repeat while the level stays on the same side
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::serviceFifo () {
+    while (true) {
+        bool above = base::readReg(base::REG_IRQFLAGS2) & base::IRQ2_FIFOLEVEL;
+        if (state == SENDING && !above) {
+            // at most THRESH bytes in the fifo, so there is room for more
+            Packet& p = txQueue[txOut];
+            int n = p.len + 1 - txPos;
+            if (n > FIFO - THRESH - 1)
+                n = FIFO - THRESH - 1;
+            if (n <= 0)
+                return;
+            base::writeBytes(p.data + txPos - 1, n);
+            txPos += n;
+        } else if (state == INCOMING && above) {
+            // over THRESH bytes in the fifo, of which THRESH can be read
+            Packet& p = queue[in];
+            int n = THRESH;
+            if (rxPos == 0) {
+                p.len = base::readReg(base::REG_FIFO);
+                rxPos = 1;
+                --n;
+            }
+            if (n > p.len + 1 - rxPos)
+                n = p.len + 1 - rxPos;
+            if (n <= 0)
+                return;
+            base::readBytes(p.data + rxPos - 1, n, MAX + 1 - rxPos);
+            rxPos += n;
+        } else
+            return;
+    }
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::startRx () {
+    rxPos = 0;
+    base::writeReg(base::REG_DIOMAPPING1, base::DIO0_SYNCADDR);
+    base::setMode(base::MODE_RECEIVE);
+    state = LISTEN;
+}
+
+// fill the fifo as far as possible, serviceFifo() will supply the rest
+template< typename SPI, int N, int NTX, int MAX >
+void RF69Irq<SPI,N,NTX,MAX>::startTx () {
+    Packet& p = txQueue[txOut];
+    state = SENDING;
+    stats.transmitted(base::airtime(p.len-2));
+    base::setMode(base::MODE_SLEEP);
+    int n = p.len < FIFO - 1 ? p.len : FIFO - 1;
+    base::writeBytes(&p.len, 1);
+    base::writeBytes(p.data, n);
+    txPos = 1 + n;
+    base::writeReg(base::REG_DIOMAPPING1, base::DIO0_PACKETSENT);
+    base::setMode(base::MODE_TRANSMIT);
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+int RF69Irq<SPI,N,NTX,MAX>::receive (void* ptr, int len) {
+    poll();
+    if (in == out)
+        return -1;
+    Packet& p = queue[out];
+    int count = p.len;
+    for (int i = 0; i < count && i < len; ++i)
+        ((uint8_t*) ptr)[i] = p.data[i];
+    base::rssi = p.rssi;
+    base::lna = p.lna;
+    base::afc = p.afc;
+    out = next(out, N);
+    return count;
+}
+
+template< typename SPI, int N, int NTX, int MAX >
+bool RF69Irq<SPI,N,NTX,MAX>::send (uint8_t header, const void* ptr, int len) {
+    if (next(txIn, NTX) == txOut || len + 2 > MAX)
+        return false;
+    Packet& p = txQueue[txIn];
+    p.data[0] = (header & 0x3F) | base::parity;
+    p.data[1] = (header & 0xC0) | base::myId;
+    for (int i = 0; i < len; ++i)
+        p.data[2+i] = ((const uint8_t*) ptr)[i];
+    p.len = len + 2;
+    txIn = next(txIn, NTX);
+    poll();
+    return true;
+}
+
+// Reliable delivery on top of RF69Irq, using the two flag bits in the header:
+//  b7 = ACK: the payload starts with the seq of a packet being acknowledged
+//  b6 = REQ: the payload starts with this packet's seq, please acknowledge
+// When both are set, the seq comes first. Each peer has one packet in flight,
+// resent with exponential backoff (based on a smoothed round-trip estimate,
+// plus some jitter) up to MAX_TRIES times. Duplicates are acked, not passed
+// on. Acks wait for the next poll(), so that a reply which the application
+// sends right after receive() carries the ack along, instead of a separate
+// packet. Broadcasts (dest 0) are sent once, unacknowledged. The flag bits
+// are reserved by this layer: received packets have them cleared, and seq
+// and ack bytes stripped, i.e. the payload is at most 61 bytes.
+
+template< typename SPI, int P =4, int N =4, int NTX =3 >
+struct RF69Link : RF69Irq<SPI,N,NTX> {
+    typedef RF69Irq<SPI,N,NTX> base;
+
+    enum { ACK = 1<<7, REQ = 1<<6, MAX_TRIES = 6, MAX_DATA = 61 };
+
+    struct Peer {
+        uint8_t id;         // 0 if this slot is unused
+        uint8_t txSeq, rxSeq, ackSeq;
+        uint8_t tries;      // number of times the current packet was sent
+        uint8_t len;
+        bool pending, rxValid, ackOwed;
+        uint16_t srtt;      // smoothed round-trip time, in ms * 8
+        uint32_t sentAt, deadline, lastUse;
+        uint8_t data [MAX_DATA];
+    };
+
+    void poll ();
+    int receive (void* ptr, int len);
+    bool send (uint8_t header, const void* ptr, int len);
+    bool busy (uint8_t dest);
+
+    Peer* find (uint8_t id);
+    Peer* lookup (uint8_t id);
+    void transmit (Peer& p);
+    void gotAck (Peer& p, uint8_t seq);
+    uint16_t timeout (Peer const& p);
+
+    Peer peers [P];
+    uint32_t seed;
+    uint16_t acked, resent, lost, dups;  // statistics
+};
+
+template< typename SPI, int P, int N, int NTX >
+typename RF69Link<SPI,P,N,NTX>::Peer* RF69Link<SPI,P,N,NTX>::find (uint8_t id) {
+    for (auto& p : peers)
+        if (p.id == id)
+            return &p;
+    return 0;
+}
+
+// find the peer, else take over an unused or the least recently used slot,
+// as long as it has nothing in flight and no ack to send
+template< typename SPI, int P, int N, int NTX >
+typename RF69Link<SPI,P,N,NTX>::Peer* RF69Link<SPI,P,N,NTX>::lookup (uint8_t id) {
+    Peer* q = find(id);
+    if (q == 0) {
+        for (auto& p : peers)
+            if (!p.pending && !p.ackOwed) {
+                if (p.id == 0) {
+                    q = &p;
+                    break;
+                }
+                if (q == 0 || (int32_t) (p.lastUse - q->lastUse) < 0)
+                    q = &p;
+            }
+        if (q == 0)
+            return 0;
+        q->id = id;
+        q->txSeq = ticks;  // avoid starting at the same seq after a restart
+        q->rxValid = false;
+        q->srtt = 50 * 8;
+    }
+    q->lastUse = ticks;
+    return q;
+}
+
+// resend after twice the round-trip estimate, doubled on each retry
+template< typename SPI, int P, int N, int NTX >
+uint16_t RF69Link<SPI,P,N,NTX>::timeout (Peer const& p) {
+    // a different increment per node id, to keep nodes from retrying in step
+    seed = seed * 1103515245 + 12345 + 2 * base::myId;
+    uint16_t t = (p.srtt >> 2) + 10;
+    if (t > 500)
+        t = 500;
+    return (t << (p.tries - 1)) + (seed >> 16) % t;
+}
+
+template< typename SPI, int P, int N, int NTX >
+void RF69Link<SPI,P,N,NTX>::transmit (Peer& p) {
+    uint8_t buf [2 + MAX_DATA];
+    uint8_t flags = REQ;
+    int n = 0;
+    buf[n++] = p.txSeq;
+    if (p.ackOwed) {
+        flags |= ACK;
+        buf[n++] = p.ackSeq;
+    }
+    for (int i = 0; i < p.len; ++i)
+        buf[n++] = p.data[i];
+    if (!base::send(flags | p.id, buf, n))
+        return;  // tx queue is full, try again on the next poll
+    p.ackOwed = false;
+    if (p.tries++ == 0)
+        p.sentAt = ticks;
+    else
+        ++resent;
+    p.deadline = ticks + timeout(p);
+}
+
+template< typename SPI, int P, int N, int NTX >
+void RF69Link<SPI,P,N,NTX>::gotAck (Peer& p, uint8_t seq) {
+    if (!p.pending || seq != p.txSeq)
+        return;  // stale or duplicate ack
+    if (p.tries == 1) {
+        // only unambiguous round trips update the estimate (Karn's rule)
+        uint32_t sample = ticks - p.sentAt;
+        if (sample > 2000)
+            sample = 2000;
+        p.srtt += sample - (p.srtt >> 3);
+    }
+    p.pending = false;
+    ++acked;
+}
+
+template< typename SPI, int P, int N, int NTX >
+void RF69Link<SPI,P,N,NTX>::poll () {
+    for (auto& p : peers) {
+        if (p.pending && (int32_t) (ticks - p.deadline) >= 0) {
+            if (p.tries < MAX_TRIES)
+                transmit(p);
+            else {
+                p.pending = false;
+                ++lost;
+            }
+        }
+        if (p.ackOwed && base::send(ACK | p.id, &p.ackSeq, 1))
+            p.ackOwed = false;
+    }
+    base::poll();
+}
+
+template< typename SPI, int P, int N, int NTX >
+int RF69Link<SPI,P,N,NTX>::receive (void* ptr, int len) {
+    poll();
+    while (true) {
+        uint8_t buf [66];
+        int n = base::receive(buf, sizeof buf);
+        if (n < 0)
+            return -1;
+
+        uint8_t flags = buf[1] & 0xC0, src = buf[1] & 0x3F;
+        int pos = 2 + (flags & REQ ? 1 : 0) + (flags & ACK ? 1 : 0);
+        if (n < pos)
+            continue;  // malformed
+
+        if (flags & ACK) {
+            Peer* p = find(src);
+            if (p != 0)
+                gotAck(*p, buf[pos-1]);
+        }
+
+        if (flags & REQ) {
+            Peer* p = lookup(src);
+            if (p == 0)
+                continue;  // no room to track this peer, it will retry
+            p->ackOwed = true;
+            p->ackSeq = buf[2];
+            if (p->rxValid && p->rxSeq == buf[2]) {
+                ++dups;
+                continue;
+            }
+            p->rxValid = true;
+            p->rxSeq = buf[2];
+        } else if (flags & ACK)
+            continue;  // a plain ack, nothing to pass on
+
+        // drop the seq and ack bytes, keep dest and src in front of the data
+        buf[pos-1] = src;
+        buf[pos-2] = buf[0];
+        n -= pos - 2;
+        for (int i = 0; i < n && i < len; ++i)
+            ((uint8_t*) ptr)[i] = buf[pos-2+i];
+        return n;
+    }
+}
+
+template< typename SPI, int P, int N, int NTX >
+bool RF69Link<SPI,P,N,NTX>::send (uint8_t header, const void* ptr, int len) {
+    uint8_t dest = header & 0x3F;
+    if (dest == 0)
+        return base::send(0, ptr, len);
+    if (len > MAX_DATA)
+        return false;
+    Peer* p = lookup(dest);
+    if (p == 0 || p->pending)
+        return false;
+    for (int i = 0; i < len; ++i)
+        p->data[i] = ((const uint8_t*) ptr)[i];
+    p->len = len;
+    ++p->txSeq;
+    p->tries = 0;
+    p->pending = true;
+    p->deadline = ticks;
+    poll();
+    return true;
+}
+
+template< typename SPI, int P, int N, int NTX >
+bool RF69Link<SPI,P,N,NTX>::busy (uint8_t dest) {
+    Peer* p = find(dest & 0x3F);
+    return p != 0 && p->pending;
+}
@@ -3,6 +3,7 @@
 // Some cards may not work, this does not use slow SPI access during init.
 
 #include <string.h>
+#include "util-cache.h"
 
 template< typename SPI >
 struct SdCard {
@@ -56,19 +57,54 @@ struct SdCard {
         wait();
     }
 
+    // multi-block read, streams cnt consecutive pages in one command
+    static void readMulti (int page, void* buf, int cnt) {
+        cmd(18, sdhc ? page : page << 9);
+        for (int n = 0; n < cnt; ++n) {
+            for (int i = 0; i < TIMEOUT; ++i)
+                if (SPI::transfer(0xFF) == 0xFE)
+                    break;
+            for (int i = 0; i < 512; ++i)
+                ((uint8_t*) buf)[i] = SPI::transfer(0xFF);
+            send16b(0xFFFF);
+            buf = (uint8_t*) buf + 512;
+        }
+        cmd(12, 0);
+        wait();
+    }
+
+    // multi-block write, the card only goes busy between blocks
+    static void writeMulti (int page, void const* buf, int cnt) {
+        cmd(25, sdhc ? page : page << 9);
+        for (int n = 0; n < cnt; ++n) {
+            send16b(0xFFFC);
+            for (int i = 0; i < 512; ++i)
+                SPI::transfer(((uint8_t const*) buf)[i]);
+            send16b(0xFFFF);
+            ready();
+            buf = (uint8_t const*) buf + 512;
+        }
+        send16b(0xFDFF);  // stop token
+        wait();
+    }
+
     static void send16b (uint16_t v) {
         SPI::transfer(v >> 8);
         SPI::transfer(v);
     }
 
     static int cmd (int req, uint32_t arg, uint8_t crc =0) {
-        SPI::disable();
+        if (req != 12) {  // keep selected when stopping a multi-block read
+            SPI::disable();
+            SPI::enable();
+        }
 
-        SPI::enable();
         send16b(0xFF40 | req);
         send16b(arg >> 16);
         send16b(arg);
         SPI::transfer(crc);
+        if (req == 12)
+            SPI::transfer(0xFF);  // skip the stuff byte
 
         for (int i = 0; i < TIMEOUT; ++i) {
             int r = SPI::transfer(0xFF);
@@ -79,10 +115,14 @@ struct SdCard {
         return -1;
     }
 
-    static void wait () {
+    static void ready () {
         for (int i = 0; i < TIMEOUT; ++i)
             if (SPI::transfer(0xFF) == 0xFF)
                 break;
+    }
+
+    static void wait () {
+        ready();
         SPI::disable();
     }
 
@@ -103,15 +143,17 @@ struct FatFS {
         T::read512(base, buf);                    // location of boot rec
         spc = buf[0x0D];                          // sectors per cluster
         rsec = *(uint16_t*) (buf+0x0E);           // reserved sectors
-        uint8_t nfc = buf[0x10];                  // number of FAT copies
-        uint16_t spf = *(uint16_t*) (buf+0x16);   // sectors per fat
+        nfc = buf[0x10];                          // number of FAT copies
+        spf = *(uint16_t*) (buf+0x16);            // sectors per fat
         rdir = nfc * spf + rsec + base;           // location of root dir
         rmax = buf[0x11] | buf[0x12]<<8;          // max root entries
         data = (rmax >> 4) + rdir;                // start of data area
         uint32_t tsc = buf[0x13] | buf[0x14]<<8;  // total sector count
         if (tsc == 0)
             tsc = *(uint32_t*) (buf+0x20);        // ... or get 32-bit count
-        clim = tsc / spc + 1;                     // cluster limit
+        clim = (tsc - (data - base)) / spc + 2;   // cluster limit
+        curr = ~0;
+        dirty = false;
 #if 0
         printf("base %d spc %d rsec %d nfc %d spf %d"
                " rdir %d rmax %d data %d tsc %d clim %d\n",
@@ -124,13 +166,11 @@ struct FatFS {
         if (cn < 2 || cn >= clim)
             return 0;
 
-        int off = clim < 4096 ? cn/2*3 : cn*2;  // 12 or 16 bits per entry
-        if (curr != off/512) {
-            curr = off/512;
-            T::read512(base + rsec + curr, buf);
-        }
+        // FAT12 has fewer than 4085 clusters, numbered from 2
+        int off = clim < 4087 ? cn/2*3 : cn*2;  // 12 or 16 bits per entry
+        load(off/512);
 
-        if (clim >= 4096)  // is it FAT16?
+        if (clim >= 4087)  // is it FAT16?
             return *(uint16_t*) (buf + off % 512);
 
         // TODO untested:
@@ -148,6 +188,56 @@ struct FatFS {
         return cn & 1 ? b1>>4 | b2<<4 : b1 | (b2&0xF)<<8;
     }
 
+    // the write support below is for FAT16 only, FAT12 volumes are read-only
+
+    // make sure the requested fat sector is in buf, saving a modified one
+    void load (uint16_t sect) {
+        if (curr != sect) {
+            flush();
+            curr = sect;
+            T::read512(base + rsec + curr, buf);
+        }
+    }
+
+    // write a modified fat sector back out, to each of the fat copies
+    void flush () {
+        if (dirty) {
+            for (int i = 0; i < nfc; ++i)
+                T::write512(base + rsec + i * spf + curr, buf);
+            dirty = false;
+        }
+    }
+
+    // find cnt consecutive free clusters, return the first one or 0 if none
+    int findFree (int cnt, int from =2) {
+        if (clim < 4087)
+            return 0;
+        int n = 0;
+        for (int cn = from < 2 ? 2 : from; cn < clim; ++cn) {
+            n = chain(cn) == 0 ? n + 1 : 0;
+            if (n >= cnt)
+                return cn - n + 1;
+        }
+        return 0;
+    }
+
+    // set a fat entry, changes are only saved on sector change or flush()
+    void setChain (int cn, uint16_t next) {
+        load(cn / 256);
+        *(uint16_t*) (buf + 2 * (cn % 256)) = next;
+        dirty = true;
+    }
+
+    // link a run of clusters, optionally append it to the tail of a chain
+    void allocate (int first, int cnt, int tail =0) {
+        if (tail >= 2)
+            setChain(tail, first);
+        for (int i = 0; i < cnt - 1; ++i)
+            setChain(first + i, first + i + 1);
+        setChain(first + cnt - 1, 0xFFFF);  // end of chain
+        flush();
+    }
+
 #if 0
     void dumpHex (int max =512) {
         for (int i = 0; i < max; i += 16) {
@@ -165,58 +255,371 @@ struct FatFS {
     uint16_t rmax;          // max root entries
     uint16_t rsec;          // reserved sectors
     uint16_t clim;          // cluster limit
+    uint16_t spf;           // sectors per fat
     uint8_t spc;            // sectors per cluster
+    uint8_t nfc;            // number of FAT copies
 
     uint16_t curr;          // current sector in buffer (during chain calls)
+    bool dirty;             // true if the fat sector in buf has been changed
     uint8_t buf [512];      // buffer space for one sector
 };
 
+// file access through a run-list, N is the max number of contiguous extents
+
 template< typename T, int N >
 struct FileMap {
-    FileMap (T& f) : fat (f) {
-        memset(map, 0, sizeof map);
-    }
+    FileMap (T& f) : fat (f), runs (0) {}
 
-    int open (char const name [11]) {
+    // scan the root dir for name, return its index, else a free slot or -1
+    int find (char const name [11], bool& found) {
+        int slot = -1;
+        fat.flush();
+        fat.curr = ~0; // consider buf to be empty at this point
         for (int i = 0; i < fat.rmax; ++i) {
             int off = (i*32) % 512;
             if (off == 0)
                 T::store::read512(fat.rdir + i/16, fat.buf);
-            if (memcmp(name, fat.buf + off, 11) == 0) {
-                int cluster = *(uint16_t*) (fat.buf + off + 26);
-                int length = *(uint32_t*) (fat.buf + off + 28);
-                //for (int j = 0; j < 11; ++j) {
-                //    if (j == 8)
-                //        printf(".");
-                //    printf("%c", name[j]);
-                //}
-                fat.curr = ~0; // consider buf to be empty at this point
-                int n = 0;
-                while (2 <= cluster && cluster < fat.clim) {
-                    //printf("%d,", cluster);
-                    map[n++] = cluster;
-                    cluster = fat.chain(cluster);
+            uint8_t first = fat.buf[off];
+            if (first == 0x00 || first == 0xE5) {
+                if (slot < 0)
+                    slot = i;
+                if (first == 0x00)
+                    break;  // end of directory
+            } else if (memcmp(name, fat.buf + off, 11) == 0) {
+                found = true;
+                return i;
+            }
+        }
+        found = false;
+        return slot;
+    }
+
+    int open (char const name [11]) {
+        bool found;
+        int i = find(name, found);
+        if (!found)
+            return -1;
+        return parse((fat.rdir + i/16) * 16 + i%16);
+    }
+
+    // open a file given the position of its directory entry, see DirIndex
+    int openAt (uint32_t pos) {
+        fat.flush();
+        fat.curr = ~0;
+        T::store::read512(pos/16, fat.buf);
+        return parse(pos);
+    }
+
+    // set up the run-list from a dir entry, its sector must be in fat.buf
+    int parse (uint32_t pos) {
+        uint8_t* p = fat.buf + (pos%16) * 32;
+        int cluster = *(uint16_t*) (p + 26);
+        entry = pos;
+        length = *(uint32_t*) (p + 28);
+        runs = 0;
+        while (2 <= cluster && cluster < fat.clim) {
+            if (!addRun(cluster, 1))
+                return -1; // too fragmented to fit in the run-list
+            cluster = fat.chain(cluster);
+        }
+        return length;
+    }
+
+    // open a file, or create it as an empty one in the root dir if missing
+    int create (char const name [11]) {
+        bool found;
+        int i = find(name, found);
+        if (found)
+            return open(name);
+        if (i < 0)
+            return -1;  // root dir is full
+        // find() may have moved on to later sectors, reload the slot's one
+        T::store::read512(fat.rdir + i/16, fat.buf);
+        uint8_t* p = fat.buf + (i*32) % 512;
+        memset(p, 0, 32);
+        memcpy(p, name, 11);
+        p[11] = 0x20;  // archive attribute
+        T::store::write512(fat.rdir + i/16, fat.buf);
+        entry = (fat.rdir + i/16) * 16 + i%16;
+        length = 0;
+        runs = 0;
+        return 0;
+    }
+
+    // number of sectors allocated to this file
+    uint32_t capacity () const {
+        uint32_t n = 0;
+        for (int i = 0; i < runs; ++i)
+            n += map[i].count;
+        return n * fat.spc;
+    }
+
+    // append cnt contiguous clusters, preferably right after the last one
+    bool grow (int cnt) {
+        int tail = runs > 0 ? map[runs-1].start + map[runs-1].count - 1 : 0;
+        int first = fat.findFree(cnt, tail + 1);
+        if (first == 0 && tail > 0)
+            first = fat.findFree(cnt);
+        if (first == 0 || !addRun(first, cnt))
+            return false;
+        fat.allocate(first, cnt, tail);
+        return true;
+    }
+
+    // preallocate enough clusters to hold the given number of bytes
+    bool reserve (uint32_t bytes) {
+        uint32_t need = (bytes + 511) / 512, have = capacity();
+        if (need <= have)
+            return true;
+        return grow((need - have + fat.spc - 1) / fat.spc);
+    }
+
+    // save the current length and first cluster in the directory entry
+    void commit () {
+        fat.flush();
+        fat.curr = ~0;
+        T::store::read512(entry/16, fat.buf);
+        uint8_t* p = fat.buf + (entry%16) * 32;
+        *(uint16_t*) (p + 26) = runs > 0 ? map[0].start : 0;
+        *(uint32_t*) (p + 28) = length;
+        T::store::write512(entry/16, fat.buf);
+    }
+
+    bool addRun (int cluster, int cnt) {
+        Extent* e = map + runs - 1;
+        if (runs > 0 && e->start + e->count == cluster)
+            e->count += cnt;
+        else if (runs < N) {
+            map[runs].start = cluster;
+            map[runs++].count = cnt;
+        } else
+            return false;
+        return true;
+    }
+
+    // map a file sector to a disk sector, return # contiguous sectors there
+    int locate (uint32_t num, uint32_t& sect) const {
+        for (int i = 0; i < runs; ++i) {
+            uint32_t n = (uint32_t) map[i].count * fat.spc;
+            if (num < n) {
+                sect = fat.data + (map[i].start - 2) * fat.spc + num;
+                return n - num;
+            }
+            num -= n;
+        }
+        return 0;
+    }
+
+    bool readRange (uint32_t num, void* buf, int cnt) {
+        while (cnt > 0) {
+            uint32_t sect;
+            int n = locate(num, sect);
+            if (n == 0)
+                return false;
+            if (n > cnt)
+                n = cnt;
+            if (n == 1)
+                T::store::read512(sect, buf);
+            else
+                BlockMulti<typename T::store>::read(sect, buf, n);
+            num += n;
+            cnt -= n;
+            buf = (uint8_t*) buf + 512 * n;
+        }
+        return true;
+    }
+
+    bool writeRange (uint32_t num, void const* buf, int cnt) {
+        while (cnt > 0) {
+            uint32_t sect;
+            int n = locate(num, sect);
+            if (n == 0)
+                return false;
+            if (n > cnt)
+                n = cnt;
+            if (n == 1)
+                T::store::write512(sect, buf);
+            else
+                BlockMulti<typename T::store>::write(sect, buf, n);
+            num += n;
+            cnt -= n;
+            buf = (uint8_t const*) buf + 512 * n;
+        }
+        return true;
+    }
+
+    struct Extent {
+        uint16_t start;     // first cluster of this run
+        uint16_t count;     // number of consecutive clusters
+    };
+
+    T& fat;
+    Extent map [N];
+    uint32_t length;        // file size in bytes
+    uint32_t entry;         // dir entry position, i.e. sector*16 + index
+    uint8_t runs;           // number of extents in use
+};
+
+// append-only writer, collects data and only writes whole sectors
+// the file grows by STEP clusters at a time when it runs out of space
+
+template< typename F, int STEP =8 >
+struct FileAppend {
+    FileAppend (F& f) : file (f) {
+        sect = file.length / 512;
+        fill = file.length % 512;
+        if (fill > 0)
+            file.readRange(sect, buf, 1);
+    }
+
+    bool write (void const* ptr, int len) {
+        uint8_t const* p = (uint8_t const*) ptr;
+        while (len > 0) {
+            int n = len / 512;
+            if (fill == 0 && n > 0) {  // whole sectors go out directly
+                if (!room(n) || !file.writeRange(sect, p, n))
+                    return false;
+                sect += n;
+                n *= 512;
+            } else {
+                n = 512 - fill < len ? 512 - fill : len;
+                memcpy(buf + fill, p, n);
+                fill += n;
+                if (fill == 512) {
+                    if (!room(1) || !file.writeRange(sect, buf, 1))
+                        return false;
+                    ++sect;
+                    fill = 0;
                 }
-                //printf(" %d @ %d, %db\n", n, cluster, length);
-                return length;
             }
+            p += n;
+            len -= n;
+            file.length = sect * 512 + fill;
         }
-        return -1;
+        return true;
     }
 
-    bool ioSect (bool wr, int num, void* buf) {
-        uint16_t grp = num / fat.spc;
-        if (grp >= N || map[grp] == 0)
+    // write out a partial last sector and update the directory entry
+    bool sync () {
+        if (fill > 0 && (!room(1) || !file.writeRange(sect, buf, 1)))
             return false;
-        uint16_t off = fat.data + (map[grp] - 2) * fat.spc + num % fat.spc;
-        //printf("rwSect(%d,%d) => %d\n", wr, num, off);
-        if (wr)
-            T::store::write512(off, buf);
-        else
-            T::store::read512(off, buf);
+        file.commit();
         return true;
     }
 
-    uint16_t map [N];
+    // make sure there are at least n allocated sectors from the current one
+    bool room (int n) {
+        uint32_t cap = file.capacity();
+        if (sect + n <= cap)
+            return true;
+        uint32_t need = (sect + n - cap + file.fat.spc - 1) / file.fat.spc;
+        return file.grow(need > STEP ? need : STEP);
+    }
+
+    F& file;
+    uint32_t sect;          // file sector being filled
+    uint16_t fill;          // number of bytes in buf
+    uint8_t buf [512];      // partial sector
+};
+
+// hashed index of all directory entries, built once after mounting
+// N is the number of slots (6 bytes each), this should have some spare room
+// names are looked up per directory, 0 for the root or the dir's 1st cluster
+
+template< typename T, int N, int DEPTH =4 >
+struct DirIndex {
+    DirIndex (T& f) : fat (f) {}
+
+    // scan root and subdirectories, returns false if the index overflowed
+    bool init () {
+        memset(tags, 0, sizeof tags);
+        count = 0;
+        return scan(0, DEPTH);
+    }
+
+    // return the position of the entry, i.e. sector*16 + index, or 0
+    uint32_t lookup (char const name [11], uint16_t dir =0) {
+        uint16_t h = hash(name, dir);
+        for (int i = h % N, n = 0; n < N && tags[i] != 0; ++n, i = (i+1) % N)
+            if (tags[i] == h) {
+                read(where[i] / 16);
+                if (memcmp(name, fat.buf + (where[i]%16) * 32, 11) == 0)
+                    return where[i];
+            }
+        return 0;
+    }
+
+    // first cluster of a subdirectory, to look up names inside it
+    uint16_t subdir (char const name [11], uint16_t dir =0) {
+        uint32_t pos = lookup(name, dir);
+        uint8_t* p = fat.buf + (pos%16) * 32;
+        return pos != 0 && (p[11] & 0x10) ? *(uint16_t*) (p + 26) : 0;
+    }
+
+    // add an entry, e.g. after FileMap::create, returns false if full
+    bool add (char const name [11], uint16_t dir, uint32_t pos) {
+        if (count >= N - 1)
+            return false;
+        uint16_t h = hash(name, dir);
+        int i = h % N;
+        while (tags[i] != 0)
+            i = (i+1) % N;
+        tags[i] = h;
+        where[i] = pos;
+        ++count;
+        return true;
+    }
+
+    static uint16_t hash (char const name [11], uint16_t dir) {
+        uint32_t h = 2166136261 ^ dir;  // FNV-1a
+        for (int i = 0; i < 11; ++i)
+            h = (h ^ (uint8_t) name[i]) * 16777619;
+        h ^= h >> 16;
+        return h != 0 ? h : 1;  // 0 marks an empty slot
+    }
+
+    void read (uint32_t sect) {
+        fat.flush();
+        fat.curr = ~0;
+        T::store::read512(sect, fat.buf);
+    }
+
+    bool scan (uint16_t dir, int depth) {
+        uint16_t cn = dir;
+        uint32_t sect = dir ? fat.data + (dir - 2) * fat.spc : fat.rdir;
+        int left = dir ? fat.spc : fat.rmax / 16;
+        while (true) {
+            read(sect);
+            for (int e = 0; e < 16; ++e) {
+                char const* p = (char const*) fat.buf + e * 32;
+                if (p[0] == 0)
+                    return true;  // end of directory
+                if (p[0] == (char) 0xE5 || p[0] == '.' || (p[11] & 0x08))
+                    continue;  // deleted, dot entry, volume label, or LFN
+                if (!add(p, dir, sect * 16 + e))
+                    return false;
+                uint16_t sub = *(uint16_t const*) (p + 26);
+                if ((p[11] & 0x10) && sub >= 2 && depth > 1) {
+                    if (!scan(sub, depth - 1))
+                        return false;
+                    read(sect);  // the sub-scan has overwritten fat.buf
+                }
+            }
+            ++sect;
+            if (--left == 0) {
+                if (dir == 0)
+                    return true;  // end of the fixed-size root dir
+                cn = fat.chain(cn);
+                if (cn < 2 || cn >= fat.clim)
+                    return true;
+                sect = fat.data + (cn - 2) * fat.spc;
+                left = fat.spc;
+            }
+        }
+    }
+
     T& fat;
+    uint16_t count;         // number of slots in use
+    uint16_t tags [N];      // name hash per slot, 0 if unused
+    uint32_t where [N];     // directory entry position per slot
 };
@@ -5,6 +5,13 @@ template< int MAX >
 struct IntelHex {
     enum { START, RECLEN, OFFSET, OFFSET2, RECTYP, DATA, CHKSUM };
 
+    // clear the extended address and start address, then wait for a ':'
+    void reset () {
+        upper = entry = 0;
+        idle = true;
+        init();
+    }
+
     void init () {
         state = START;
         count = check = 0;
@@ -13,20 +20,64 @@ struct IntelHex {
     // return true when the parse is done, with check == 0 if no errors
     // else if state == 6, it's a checksum error, all data has been read
     bool parse (int c) {
-        int pos;
-
-        if ('0' <= c && c <= '9')
-            c -= '0';
-        else if ('A' <= c && c <= 'F')
-            c -= 'A' - 10;
-        else {
+        uint8_t v = (unsigned) c < 128 ? digits[c] : 0x10;
+        if (v & 0x10) {
             check = 1;
             return true;
         }
 
-        value = (value<<4) | c;
+        value = (value<<4) | v;
         if (++count & 1)
             return false;
+        return step();
+    }
+
+    // parse a buffer with any number of records, skipping text outside them,
+    // returns the number of characters used, up to the end of the first
+    // completed record (see ready) or else all
+    int parse (char const* buf, int len) {
+        auto p = (uint8_t const*) buf;
+        if (idle)
+            init();
+        for (int i = 0; i < len; ) {
+            if (idle) {
+                if (p[i++] == ':') {
+                    init();
+                    idle = false;
+                }
+                continue;
+            }
+            bool done;
+            uint8_t hi, lo;
+            if ((count & 1) == 0 && i + 1 < len && p[i] < 128 && p[i+1] < 128 &&
+                    ((hi = digits[p[i]]) | (lo = digits[p[i+1]])) < 0x10) {
+                value = (value<<8) | (hi<<4) | lo;  // two digits at once
+                count += 2;
+                i += 2;
+                done = step();
+            } else
+                done = parse(p[i++]);
+            if (done) {
+                idle = true;
+                return i;
+            }
+        }
+        return len;
+    }
+
+    // true if the last buffer parse ended a record, or ran into an error
+    bool ready () const {
+        return idle && (state != START || check != 0);
+    }
+
+    // the full 32-bit address of the current data record
+    uint32_t address () const {
+        return upper + addr;
+    }
+
+    // process the byte in the low half of value, the high half is the previous
+    bool step () {
+        int pos;
         check += value;
 
         switch (++state) {
@@ -46,13 +97,30 @@ struct IntelHex {
                               --state; // more DATA
                           break;
             default:      check = 1;
-                          // fall through
-            case CHKSUM:  return true;
+                          return true;
+            case CHKSUM:  if (check == 0)
+                              special();
+                          return true;
         }
 
         return false;
     }
 
+    // track the extended address (types 2 and 4) and start address (3 and 5)
+    void special () {
+        uint32_t v = 0;
+        for (int i = 0; i < len && i < 4 && i < MAX; ++i)
+            v = (v<<8) | data[i];
+        switch (type) {
+            case 2: upper = v << 4; break;
+            case 4: upper = v << 16; break;
+            case 3:
+            case 5: entry = v; break;
+        }
+    }
+
+    uint32_t upper;
+    uint32_t entry;
     uint16_t value;
     uint16_t count;
     uint16_t addr;
@@ -60,5 +128,232 @@ struct IntelHex {
     uint8_t len;
     uint8_t state;
     uint8_t type;
+    bool idle;
     uint8_t data [MAX];
+
+    static uint8_t const digits [128];  // hex digit values, 0x10 if invalid
+};
+
+template< int MAX >
+uint8_t const IntelHex<MAX>::digits [128] = {
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,16,16,16,16,16,16,
+    16,10,11,12,13,14,15,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+    16,10,11,12,13,14,15,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+};
+
+// Streaming flasher, writes Intel hex text to flash memory. Data is collected
+// in a PAGE-sized buffer while the previous page is being programmed by poll()
+// in small steps, so that flashing keeps up with the incoming records. Each
+// erase unit is erased on first touch, unless it is blank already. Its bounds
+// come from E, which must match what F::erasePage really clears: uniform pages
+// by default, FlashSectors for the 16/64/128 KB sectors of F4 and F7. Records
+// may come in any order within a page, but pages must be in ascending address
+// order: going back into an already erased and programmed area is an error.
+// Uses F::program and F::erasePage, i.e. the arch's Flash struct. Addresses
+// are offsets from the start of flash, below "limit" or past SIZE is an error,
+// as is an erase unit which reaches below "limit" and is not blank.
+
+#include "util-crc.h"
+
+// uniform erase pages of N bytes, as on F1, F3, L0, L4, and G0
+template< int N >
+struct FlashPages {
+    static uint32_t start (uint32_t off) { return off - off % N; }
+    static uint32_t end (uint32_t off) { return start(off) + N; }
+};
+
+// 4x 16 KB, 64 KB, then 128 KB sectors, as in erasePage on F4 and F7
+struct FlashSectors {
+    static uint32_t start (uint32_t off) {
+        return off < 0x10000 ? off & ~0x3FFF :
+               off < 0x20000 ? 0x10000 : off & ~0x1FFFF;
+    }
+    static uint32_t end (uint32_t off) {
+        return off < 0x10000 ? start(off) + 0x4000 :
+               off < 0x20000 ? 0x20000 : start(off) + 0x20000;
+    }
+};
+
+template< typename F, uint32_t SIZE, int PAGE =1024,
+          typename E =FlashPages<PAGE> >
+struct HexFlasher {
+    constexpr static uint32_t FLASH = 0x08000000;
+    constexpr static int STEP = 32;   // bytes to program per poll() call
+    constexpr static int SPANS = 8;   // max separate ranges to verify
+
+    static_assert(PAGE % STEP == 0 && STEP % F::unit == 0, "invalid sizes");
+
+    struct Page {
+        uint32_t base;
+        uint16_t lo, hi, pos;   // filled range, and programming progress
+        uint8_t buf [PAGE];
+    };
+
+    struct Span {
+        uint32_t addr, len;
+    };
+
+    void init (uint32_t lo =0) {
+        hex.reset();
+        limit = lo;
+        sum = 0xFFFF;
+        error = done = false;
+        spans = 0;
+        cur = 0;
+        page[0].lo = page[1].lo = PAGE;
+        page[0].hi = page[1].hi = 0;
+        erased = high = 0;
+    }
+
+    // feed one character of hex text, returns false once an error occurred
+    bool feed (int c) {
+        char ch = c;
+        return feed(&ch, 1);
+    }
+
+    bool feed (char const* buf, int len) {
+        while (len > 0 && !error) {
+            int n = hex.parse(buf, len);
+            if (hex.ready()) {
+                if (hex.check != 0 || hex.len > sizeof hex.data)
+                    error = true;
+                else
+                    apply();
+            }
+            buf += n;
+            len -= n;
+            poll();
+        }
+        return !error;
+    }
+
+    // program the next few bytes of the previously filled page, if any
+    void poll () {
+        Page& p = page[1-cur];
+        if (p.lo >= p.hi || error)
+            return;
+        int n = p.hi - p.pos < STEP ? p.hi - p.pos : STEP;
+        void const* a = (void const*) (FLASH + p.base + p.pos);
+        if (!F::program(a, p.buf + p.pos, n))
+            error = true;
+        sum = CRC16::calculate(p.buf + p.pos, n, sum);
+        p.pos += n;
+        if (p.pos >= p.hi)
+            p.lo = PAGE;  // done
+    }
+
+    // write out everything, then check the crc of all data written to flash
+    bool finish () {
+        swap();
+        swap();
+        if (error)
+            return false;
+        uint16_t crc = 0xFFFF;
+        for (int i = 0; i < spans; ++i)
+            crc = CRC16::calculate((void const*) (FLASH + span[i].addr),
+                                    span[i].len, crc);
+        return crc == sum;
+    }
+
+    void apply () {
+        if (hex.type == 0)
+            for (int i = 0; i < hex.len; ++i)
+                put(hex.address() + i, hex.data[i]);
+        else if (hex.type == 1)
+            done = true;
+    }
+
+    void put (uint32_t addr, uint8_t val) {
+        addr &= 0x07FFFFFF;
+        if (addr < limit || addr >= SIZE || addr < high) {
+            error = true;
+            return;
+        }
+        uint32_t base = addr - addr % PAGE;
+        Page& p = page[cur];
+        if (p.lo < p.hi && p.base != base)
+            swap();
+        Page& q = page[cur];
+        if (q.lo >= q.hi) {
+            q.base = base;
+            for (int i = 0; i < PAGE; ++i)
+                q.buf[i] = 0xFF;
+        }
+        int off = addr - base;
+        if (q.lo > off)
+            q.lo = off;
+        if (q.hi < off + 1)
+            q.hi = off + 1;
+        q.buf[off] = val;
+    }
+
+    // wait for the previous page to be written, then start on this one
+    void swap () {
+        Page& p = page[1-cur];
+        while (p.lo < p.hi && !error)
+            poll();
+        p.lo = PAGE;
+        p.hi = 0;
+        cur = 1 - cur;
+        if (page[1-cur].lo < page[1-cur].hi)
+            prepare(page[1-cur]);
+    }
+
+    // align to the flash programming unit, erase if needed, and track spans
+    void prepare (Page& p) {
+        p.lo -= p.lo % F::unit;
+        p.hi += (F::unit - p.hi % F::unit) % F::unit;
+        p.pos = p.lo;
+
+        uint32_t from = p.base + p.lo, to = p.base + p.hi;
+        if (from < high) {
+            error = true;  // out of order, this area has been programmed
+            return;
+        }
+        high = to;
+
+        for (uint32_t u = E::start(from); u < to; u = E::end(u))
+            if (u >= erased) {
+                erased = E::end(u);
+                if (!blank(u, erased)) {
+                    if (u < limit) {
+                        error = true;  // would wipe what is below limit
+                        return;
+                    }
+                    F::erasePage((void const*) (FLASH + u));
+                }
+            }
+
+        if (spans > 0 && span[spans-1].addr + span[spans-1].len == from)
+            span[spans-1].len += to - from;
+        else if (spans < SPANS) {
+            span[spans].addr = from;
+            span[spans].len = to - from;
+            ++spans;
+        } else
+            error = true;  // too fragmented to verify
+    }
+
+    static bool blank (uint32_t from, uint32_t to) {
+        auto p = (uint32_t const*) (FLASH + from);
+        for (uint32_t i = 0; i < (to - from) / 4; ++i)
+            if (p[i] != 0xFFFFFFFF)
+                return false;
+        return true;
+    }
+
+    IntelHex<64> hex;
+    Page page [2];
+    Span span [SPANS];
+    uint32_t limit;
+    uint32_t erased;        // erase units below this have been dealt with
+    uint32_t high;          // end of the area handed out for programming
+    uint16_t sum;
+    uint8_t cur, spans;
+    bool error, done;
 };
@@ -0,0 +1,193 @@
+// Write-back block cache, to sit between a block store and its users.
+// The store needs static read512/write512 (B = 512) or read256/write256
+// (B = 256) calls, as in SdCard, SpiFlash, and Fram. Block n lives in set
+// n % S, which has W lines with lru replacement, i.e. S = 1 is fully
+// associative. On a read miss, up to AHEAD following blocks are also loaded,
+// but only below the store size given to init(). Writes stay in the cache
+// until evicted or until flush() is called. Multi-block transfers go straight
+// to the store, so this can also sit in front of stores without them.
+
+#pragma once
+#include <string.h>
+
+template< typename T, int B >
+struct BlockStore;
+
+template< typename T >
+struct BlockStore<T,512> {
+    static void read (int n, void* p) { T::read512(n, p); }
+    static void write (int n, void const* p) { T::write512(n, p); }
+};
+
+template< typename T >
+struct BlockStore<T,256> {
+    static void read (int n, void* p) { T::read256(n, p); }
+    static void write (int n, void const* p) { T::write256(n, p); }
+};
+
+// multi-block transfers, with the store's readMulti/writeMulti if it has
+// them, as SdCard does, else one block at a time
+
+template< typename T, int B =512 >
+struct BlockMulti {
+    static void read (int n, void* p, int cnt) { read<T>(n, p, cnt, 0); }
+    static void write (int n, void const* p, int cnt) { write<T>(n, p, cnt, 0); }
+
+    template< typename U >
+    static auto read (int n, void* p, int cnt, int)
+                                -> decltype(U::readMulti(n, p, cnt)) {
+        return U::readMulti(n, p, cnt);
+    }
+    template< typename U >
+    static void read (int n, void* p, int cnt, long) {
+        for (int i = 0; i < cnt; ++i)
+            BlockStore<U,B>::read(n + i, (uint8_t*) p + B * i);
+    }
+
+    template< typename U >
+    static auto write (int n, void const* p, int cnt, int)
+                                -> decltype(U::writeMulti(n, p, cnt)) {
+        return U::writeMulti(n, p, cnt);
+    }
+    template< typename U >
+    static void write (int n, void const* p, int cnt, long) {
+        for (int i = 0; i < cnt; ++i)
+            BlockStore<U,B>::write(n + i, (uint8_t const*) p + B * i);
+    }
+};
+
+template< typename T, int B, int W, int S =1, int AHEAD =0 >
+struct BlockCache {
+    typedef BlockStore<T,B> io;
+    constexpr static int L = S * W;
+    static_assert(L <= 64, "dirty bits are kept in a 64-bit mask");
+
+    // blocks is the size of the store, only needed for read-ahead
+    static void init (int blocks =0) {
+        for (int i = 0; i < L; ++i)
+            tag[i] = 0;
+        limit = blocks;
+        dirty = 0;
+        clock = hits = misses = writes = 0;
+    }
+
+    static void read (int n, void* p) {
+        int i = find(n);
+        bool miss = i < 0;
+        if (miss) {
+            ++misses;
+            i = claim(n);
+            io::read(n, line[i]);
+        } else
+            ++hits;
+        stamp[i] = ++clock;
+        memcpy(p, line[i], B);
+        if (miss)
+            for (int k = 1; k <= AHEAD && n + k < limit; ++k)
+                if (find(n + k) < 0)
+                    io::read(n + k, line[claim(n + k)]);
+    }
+
+    static void write (int n, void const* p) {
+        int i = find(n);
+        if (i >= 0)
+            ++hits;
+        else {
+            ++misses;
+            i = claim(n);  // whole block is replaced, no need to load it
+        }
+        stamp[i] = ++clock;
+        memcpy(line[i], p, B);
+        dirty |= 1ULL << i;
+    }
+
+    // write all modified blocks back to the store
+    static void flush () {
+        for (int i = 0; i < L; ++i)
+            save(i);
+    }
+
+    // same calls as the store, so the cache can be used in its place
+    static void read512 (int n, void* p) { read(n, p); }
+    static void write512 (int n, void const* p) { write(n, p); }
+    static void read256 (int n, void* p) { read(n, p); }
+    static void write256 (int n, void const* p) { write(n, p); }
+
+    // multi-block transfers bypass the cache, but keep it coherent
+    static void readMulti (int n, void* p, int cnt) {
+        for (int i = 0; i < L; ++i)
+            if (n < tag[i] && tag[i] <= n + cnt)
+                save(i);
+        BlockMulti<T,B>::read(n, p, cnt);
+    }
+
+    static void writeMulti (int n, void const* p, int cnt) {
+        for (int i = 0; i < L; ++i)
+            if (n < tag[i] && tag[i] <= n + cnt) {
+                dirty &= ~(1ULL << i);
+                tag[i] = 0;
+            }
+        BlockMulti<T,B>::write(n, p, cnt);
+    }
+
+    static int find (int n) {
+        int base = (n % S) * W;
+        for (int i = base; i < base + W; ++i)
+            if (tag[i] == n + 1)
+                return i;
+        return -1;
+    }
+
+    // pick the least recently used line in the set, after saving it
+    static int claim (int n) {
+        int base = (n % S) * W, i = base;
+        for (int j = base; j < base + W; ++j) {
+            if (tag[j] == 0) {
+                i = j;
+                break;
+            }
+            if ((int32_t) (stamp[j] - stamp[i]) < 0)
+                i = j;
+        }
+        save(i);
+        tag[i] = n + 1;
+        stamp[i] = clock;
+        return i;
+    }
+
+    static void save (int i) {
+        if (dirty & (1ULL << i)) {
+            io::write(tag[i] - 1, line[i]);
+            dirty &= ~(1ULL << i);
+            ++writes;
+        }
+    }
+
+    static int tag [L];             // block + 1 in each line, 0 if unused
+    static int limit;               // size of the store, in blocks
+    static uint32_t stamp [L];      // last use, for lru replacement
+    static uint64_t dirty;          // one bit per modified line
+    static uint32_t clock;          // increments on each access
+    static uint8_t line [L][B];
+
+    static uint32_t hits, misses, writes;  // statistics
+};
+
+template< typename T, int B, int W, int S, int AHEAD >
+int BlockCache<T,B,W,S,AHEAD>::tag [L];
+template< typename T, int B, int W, int S, int AHEAD >
+int BlockCache<T,B,W,S,AHEAD>::limit;
+template< typename T, int B, int W, int S, int AHEAD >
+uint32_t BlockCache<T,B,W,S,AHEAD>::stamp [L];
+template< typename T, int B, int W, int S, int AHEAD >
+uint64_t BlockCache<T,B,W,S,AHEAD>::dirty;
+template< typename T, int B, int W, int S, int AHEAD >
+uint32_t BlockCache<T,B,W,S,AHEAD>::clock;
+template< typename T, int B, int W, int S, int AHEAD >
+uint8_t BlockCache<T,B,W,S,AHEAD>::line [L][B];
+template< typename T, int B, int W, int S, int AHEAD >
+uint32_t BlockCache<T,B,W,S,AHEAD>::hits;
+template< typename T, int B, int W, int S, int AHEAD >
+uint32_t BlockCache<T,B,W,S,AHEAD>::misses;
+template< typename T, int B, int W, int S, int AHEAD >
+uint32_t BlockCache<T,B,W,S,AHEAD>::writes;
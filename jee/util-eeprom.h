@@ -0,0 +1,212 @@
+// EEPROM emulation in internal flash memory, wear-levelled over PAGES flash
+// pages (or sectors) of PAGE bytes each, starting at BASE. Each update is
+// appended as a record with a 16-bit key, a crc, and a 32-bit value, so the
+// latest record for a key holds its current value. When the active page fills
+// up, the latest values are copied to the next page, round-robin. Uses the
+// arch's Flash struct, records take 8 bytes or F::unit if that is larger.
+// Writes are verified: when one fails, everything is moved to the next page,
+// and put() only returns true once the new values are safely in flash.
+
+#include "util-crc.h"
+
+template< typename F, uint32_t BASE, uint32_t PAGE, int PAGES =2 >
+struct FlashEeprom {
+    constexpr static uint32_t MAGIC = 0x45455046;  // "FPEE"
+    constexpr static int CHUNK = 16;  // records per batched write
+    constexpr static int REC = F::unit > 8 ? F::unit : 8;
+
+    static_assert(PAGES >= 2, "at least two pages are needed");
+
+    // find the active page, and finish or undo an interrupted page copy
+    static void init () {
+        curr = -1;
+        for (int p = 0; p < PAGES; ++p)
+            if (valid(p) && !retired(p)) {
+                if (curr < 0)
+                    curr = p;
+                else {
+                    // the newer page is an incomplete copy, drop it
+                    int32_t d = word(p, 0) - word(curr, 0);
+                    int drop = d > 0 ? p : curr;
+                    curr = d > 0 ? curr : p;
+                    F::erasePage((void const*) base(drop));
+                }
+            }
+        if (curr < 0)
+            format(0, 1);
+        fill = 2*REC;
+        while (fill < PAGE && !blank(curr, fill))
+            fill += REC;
+    }
+
+    static bool get (uint16_t key, uint32_t& val) {
+        for (uint32_t off = fill; off > 2*REC; ) {
+            off -= REC;
+            if (check(curr, off) && (uint16_t) word(curr, off) == key) {
+                val = word(curr, off + 4);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool put (uint16_t key, uint32_t val) {
+        return put(&key, &val, 1);
+    }
+
+    // store several values with as few flash unlocks as possible, unchanged
+    // values are skipped, the key 0xFFFF is reserved
+    static bool put (uint16_t const* keys, uint32_t const* vals, int n) {
+        int changed = 0;
+        for (int i = 0; i < n; ++i)
+            if (differs(keys, vals, i))
+                ++changed;
+        if (changed == 0)
+            return true;
+        if (fill + REC * changed > PAGE)
+            return reclaim(keys, vals, n);
+        bool ok = true;
+        for (int i = 0; i < n; ++i)
+            if (differs(keys, vals, i))
+                ok = stage(keys[i], vals[i]) && ok;
+        ok = flush() && ok;
+        // what failed to program can't be written again, start a fresh page
+        return ok || reclaim(keys, vals, n);
+    }
+
+    // free space, in records
+    static int spare () {
+        return (PAGE - fill) / REC;
+    }
+
+    static uint32_t base (int p) {
+        return BASE + p * PAGE;
+    }
+
+    static uint32_t word (int p, uint32_t off) {
+        return *(uint32_t const*) (base(p) + off);
+    }
+
+    // the header is the page's sequence number, xor'ed with MAGIC as check
+    static bool valid (int p) {
+        return word(p, 0) != 0xFFFFFFFF && word(p, 4) == (word(p, 0) ^ MAGIC);
+    }
+
+    // the 2nd slot is written once the page has been copied
+    static bool retired (int p) {
+        return !blank(p, REC);
+    }
+
+    static bool blank (int p, uint32_t off) {
+        return word(p, off) == 0xFFFFFFFF && word(p, off + 4) == 0xFFFFFFFF;
+    }
+
+    static uint16_t crc (uint16_t key, uint32_t val) {
+        return CRC16::calculate(&val, 4, CRC16::calculate(&key, 2));
+    }
+
+    // a torn record fails its crc check and is skipped
+    static bool check (int p, uint32_t off) {
+        uint32_t w = word(p, off);
+        return w != 0xFFFFFFFF && (w >> 16) == crc(w, word(p, off + 4));
+    }
+
+    static bool format (int p, uint32_t seq) {
+        F::erasePage((void const*) base(p));
+        uint32_t hdr [2] = { seq, seq ^ MAGIC };
+        curr = p;
+        return F::program((void const*) base(p), hdr, 8);
+    }
+
+    // returns false if staging this record caused a failed flush
+    static bool stage (uint16_t key, uint32_t val) {
+        uint32_t* r = pend + npend * (REC/4);
+        for (int i = 2; i < REC/4; ++i)
+            r[i] = 0xFFFFFFFF;
+        r[0] = key | (crc(key, val) << 16);
+        r[1] = val;
+        return ++npend < CHUNK || flush();
+    }
+
+    // write the staged records, fill only moves past them if they verify
+    static bool flush () {
+        if (npend == 0)
+            return true;
+        bool ok = F::program((void const*) (base(curr) + fill), pend, REC * npend);
+        if (ok)
+            fill += REC * npend;
+        npend = 0;
+        return ok;
+    }
+
+    // is this the last record for its key in page p, below limit?
+    static bool latest (int p, uint32_t off, uint32_t limit) {
+        uint16_t key = word(p, off);
+        for (off += REC; off < limit; off += REC)
+            if (check(p, off) && (uint16_t) word(p, off) == key)
+                return false;
+        return true;
+    }
+
+    static bool member (uint16_t key, uint16_t const* keys, int n) {
+        for (int i = 0; i < n; ++i)
+            if (keys[i] == key)
+                return true;
+        return false;
+    }
+
+    // a key which occurs earlier in the batch must always be written again
+    static bool differs (uint16_t const* keys, uint32_t const* vals, int i) {
+        uint32_t v;
+        return member(keys[i], keys, i) || !get(keys[i], v) || v != vals[i];
+    }
+
+    // copy the current values and the new ones to the next page, then
+    // retire the old page - fails without changes if they won't all fit
+    static bool reclaim (uint16_t const* keys, uint32_t const* vals, int n) {
+        int from = curr;
+        uint32_t limit = fill, need = (2 + n) * REC;
+        for (uint32_t off = 2*REC; off < limit; off += REC)
+            if (check(from, off) && latest(from, off, limit) &&
+                    !member(word(from, off), keys, n))
+                need += REC;
+        if (need > PAGE)
+            return false;
+
+        bool ok = format((from + 1) % PAGES, word(from, 0) + 1);
+        fill = 2*REC;
+        for (uint32_t off = 2*REC; ok && off < limit; off += REC)
+            if (check(from, off) && latest(from, off, limit) &&
+                    !member(word(from, off), keys, n))
+                ok = stage(word(from, off), word(from, off + 4));
+        for (int i = 0; ok && i < n; ++i)
+            ok = stage(keys[i], vals[i]);
+        ok = ok && flush();
+        if (!ok) {
+            // stay on the old page, init() drops the incomplete copy
+            npend = 0;
+            curr = from;
+            fill = limit;
+            return false;
+        }
+
+        uint32_t done [2] = { 0, 0 };
+        if (!F::program((void const*) (base(from) + REC), done, 8))
+            F::erasePage((void const*) base(from));  // retire it anyway
+        return true;
+    }
+
+    static int curr;            // active page
+    static uint32_t fill;       // offset of the next free record
+    static uint32_t pend [CHUNK*REC/4];
+    static int npend;
+};
+
+template< typename F, uint32_t BASE, uint32_t PAGE, int PAGES >
+int FlashEeprom<F,BASE,PAGE,PAGES>::curr;
+template< typename F, uint32_t BASE, uint32_t PAGE, int PAGES >
+uint32_t FlashEeprom<F,BASE,PAGE,PAGES>::fill;
+template< typename F, uint32_t BASE, uint32_t PAGE, int PAGES >
+uint32_t FlashEeprom<F,BASE,PAGE,PAGES>::pend [CHUNK*REC/4];
+template< typename F, uint32_t BASE, uint32_t PAGE, int PAGES >
+int FlashEeprom<F,BASE,PAGE,PAGES>::npend;
@@ -0,0 +1,443 @@
+// Over-the-air firmware updates, as block-level deltas over a packet link.
+// The image is split into B-byte blocks, each with a CRC32 as hash. A node
+// asks the server for its current image (OtaClient::update), gets the block
+// hashes, and compares them against its running image: unchanged blocks are
+// copied locally, only the others are fetched, in chunks of 56 bytes. Each
+// block is checked against its hash once complete, and refetched if it does
+// not match. The new image is assembled in a staging area, then checked as
+// a whole, and marked ready by a trailer after the last block. At the next
+// boot, OtaStage::install copies it over the running image, i.e. this must
+// be called from a small bootloader which lives outside the image area. It
+// is safe to power-cycle at any point: an interrupted or failed install is
+// redone on the next boot, up to OtaStage::TRIES times, after which the
+// staged image is dropped.
+//
+// The link needs send(dest, ptr, len), which returns false if it can't be
+// sent right now, and busy(dest), as in RF69Link. Received packets are to be
+// passed to handle() as [dest][src][payload], again as from RF69Link. The
+// server keeps no per-node state, it can serve any number of nodes at once.
+//
+// Image areas use a simple store interface, with offsets in bytes:
+//  - ERASE, the size of an erase unit, all writes are to erased units
+//  - read(off, buf, len), write(off, buf, len) (returns false on error)
+//  - erase(off), erases the unit starting at off
+// OtaFlash adapts the arch's Flash (families with uniform pages, e.g. F1,
+// L0, G0), OtaSpiFlash uses a SpiFlash chip, with 4 KB erase sectors.
+
+#include <string.h>
+#include "util-crc.h"
+
+template< typename F, uint32_t BASE, int PAGE >
+struct OtaFlash {
+    constexpr static uint32_t FLASH = 0x08000000;
+    constexpr static int ERASE = PAGE;
+
+    static void read (uint32_t off, void* buf, int len) {
+        memcpy(buf, (void const*) (FLASH + BASE + off), len);
+    }
+    static bool write (uint32_t off, void const* buf, int len) {
+        return F::program((void const*) (FLASH + BASE + off), buf, len);
+    }
+    static void erase (uint32_t off) {
+        F::erasePage((void const*) (FLASH + BASE + off));
+    }
+};
+
+template< typename SF, uint32_t BASE >
+struct OtaSpiFlash {
+    constexpr static int ERASE = 4096;
+
+    static void read (uint32_t off, void* buf, int len) {
+        SF::read(BASE + off, buf, len);
+    }
+    static bool write (uint32_t off, void const* buf, int len) {
+        SF::write(BASE + off, buf, len);
+        return true;  // the image hash is checked once it's complete
+    }
+    static void erase (uint32_t off) {
+        SF::erase((BASE + off) >> 8);
+    }
+};
+
+struct Ota {
+    enum { QUERY = 0xF0, OFFER, HASHREQ, HASHES, GET, DATA };
+    enum { CHUNK = 56, NHASH = 14 };  // both fit in a 61-byte payload
+
+    // crc32 of a buffer, or of an area in a store
+    static uint32_t hash (void const* ptr, int len) {
+        CRC32 crc;
+        crc.update(ptr, len);
+        return crc.value();
+    }
+
+    template< typename S >
+    static uint32_t hash (uint32_t off, uint32_t len) {
+        CRC32 crc;
+        uint8_t buf [64];
+        while (len > 0) {
+            int n = len < sizeof buf ? len : sizeof buf;
+            S::read(off, buf, n);
+            crc.update(buf, n);
+            off += n;
+            len -= n;
+        }
+        return crc.value();
+    }
+
+    // write len bytes, erasing each unit as the first byte in it is written,
+    // i.e. an area must be filled in ascending order
+    template< typename S >
+    static bool put (uint32_t off, void const* buf, int len) {
+        uint32_t a = (off + S::ERASE - 1) / S::ERASE * S::ERASE;
+        for (; a < off + len; a += S::ERASE)
+            S::erase(a);
+        return S::write(off, buf, len);
+    }
+
+    static uint16_t get16 (uint8_t const* p) { return p[0] | (p[1] << 8); }
+    static uint32_t get32 (uint8_t const* p) { return get16(p) | (get16(p+2) << 16); }
+    static void put16 (uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+    static void put32 (uint8_t* p, uint32_t v) { put16(p, v); put16(p+2, v >> 16); }
+};
+
+// The staging area holds up to SIZE bytes, plus one erase unit for the
+// trailer, followed by one 8-byte mark per install attempt (8 bytes, so that
+// flash which is programmed in double words can also clear them one by one).
+// SIZE must be a multiple of both erase units and of B.
+
+template< typename APP, typename STAGE, uint32_t SIZE, int B =1024 >
+struct OtaStage {
+    constexpr static uint32_t MAGIC = 0x41544F35;  // "5OTA"
+    constexpr static int TRIES = 4;  // install attempts before giving up
+    static_assert(SIZE % APP::ERASE == 0 && SIZE % STAGE::ERASE == 0 &&
+                    SIZE % B == 0, "SIZE must be a multiple of all units");
+
+    struct Trailer {
+        uint32_t magic, size, hash, check;  // check is ~hash
+    };
+
+    // is there a complete, verified image waiting to be installed?
+    static bool pending (Trailer& t) {
+        STAGE::read(SIZE, &t, sizeof t);
+        return t.magic == MAGIC && t.check == ~t.hash && t.size <= SIZE &&
+                Ota::hash<STAGE>(0, t.size) == t.hash;
+    }
+
+    static bool commit (uint32_t size, uint32_t hash) {
+        Trailer t = { MAGIC, size, hash, ~hash };
+        return Ota::put<STAGE>(SIZE, &t, sizeof t);
+    }
+
+    static void discard () {
+        STAGE::erase(SIZE);
+    }
+
+    // clear the next unused attempt mark, false if there are none left
+    static bool attempt () {
+        uint8_t mark [8];
+        for (int i = 0; i < TRIES; ++i) {
+            uint32_t off = SIZE + sizeof (Trailer) + sizeof mark * i;
+            STAGE::read(off, mark, sizeof mark);
+            bool unused = true;
+            for (uint32_t j = 0; j < sizeof mark; ++j)
+                unused = unused && mark[j] == 0xFF;
+            if (unused) {
+                memset(mark, 0, sizeof mark);
+                STAGE::write(off, mark, sizeof mark);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // copy a pending image into place, returns true if one was installed
+    static bool install () {
+        Trailer t;
+        if (!pending(t))
+            return false;
+        if (!attempt()) {
+            discard();  // this image can't be installed, make room for another
+            return false;
+        }
+        uint8_t buf [256];
+        for (uint32_t off = 0; off < t.size; off += sizeof buf) {
+            int n = t.size - off < sizeof buf ? t.size - off : sizeof buf;
+            STAGE::read(off, buf, n);
+            if (!Ota::put<APP>(off, buf, n))
+                return false;  // leave the trailer, try again on the next boot
+        }
+        if (Ota::hash<APP>(0, t.size) != t.hash)
+            return false;  // same as above
+        discard();
+        return true;
+    }
+};
+
+// Serves the image in IMG, a store as above, of which only read() is used.
+
+template< typename L, typename IMG, int B =1024 >
+struct OtaServer {
+    OtaServer (L& l) : link (l) {}
+
+    void init (uint32_t bytes) {
+        size = bytes;
+        hash = Ota::hash<IMG>(0, size);
+        requests = heldLen = 0;
+    }
+
+    // retry a reply which could not be sent right away
+    void poll () {
+        if (heldLen > 0 && link.send(heldDest, held, heldLen))
+            heldLen = 0;
+    }
+
+    // returns false if this packet is not an ota request
+    bool handle (uint8_t const* pkt, int len) {
+        if (len < 3 || pkt[2] < Ota::QUERY || pkt[2] > Ota::DATA)
+            return false;
+        uint8_t src = pkt[1] & 0x3F;
+        uint8_t const* p = pkt + 2;
+        uint8_t reply [5 + Ota::CHUNK];
+        int n = 0;
+        ++requests;
+        switch (p[0]) {
+            case Ota::QUERY:
+                reply[0] = Ota::OFFER;
+                Ota::put32(reply+1, size);
+                Ota::put32(reply+5, hash);
+                Ota::put16(reply+9, B);
+                n = 11;
+                break;
+            case Ota::HASHREQ:
+                if (len < 5)
+                    return true;
+                reply[0] = Ota::HASHES;
+                reply[1] = p[1];
+                reply[2] = p[2];
+                reply[3] = 0;
+                n = 4;
+                for (uint32_t i = Ota::get16(p+1); i * B < size &&
+                                            reply[3] < Ota::NHASH; ++i) {
+                    uint32_t bytes = size - i * B < B ? size - i * B : B;
+                    Ota::put32(reply + n, Ota::hash<IMG>(i * B, bytes));
+                    ++reply[3];
+                    n += 4;
+                }
+                break;
+            case Ota::GET: {
+                if (len < 7)
+                    return true;
+                uint16_t pos = Ota::get16(p+3);
+                uint32_t off = Ota::get16(p+1) * B + pos;
+                if (off >= size || pos >= B)
+                    return true;
+                memcpy(reply, p, 5);
+                reply[0] = Ota::DATA;
+                n = B - pos < Ota::CHUNK ? B - pos : Ota::CHUNK;  // stay in block
+                if ((uint32_t) n > size - off)
+                    n = size - off;
+                IMG::read(off, reply + 5, n);
+                n += 5;
+                break;
+            }
+            default:
+                return true;
+        }
+        // the link may still be busy with the previous reply to this node,
+        // keep one reply for later, the client will time out and ask again
+        // if it's replaced by one for another node
+        if (!link.send(src, reply, n)) {
+            memcpy(held, reply, n);
+            heldLen = n;
+            heldDest = src;
+        }
+        return true;
+    }
+
+    L& link;
+    uint32_t size, hash;
+    uint8_t held [5 + Ota::CHUNK];
+    uint8_t heldLen, heldDest;
+    uint32_t requests;
+};
+
+// Receives an update into STAGE, copying unchanged blocks from APP.
+
+template< typename L, typename APP, typename STAGE, uint32_t SIZE, int B =1024 >
+struct OtaClient : OtaStage<APP,STAGE,SIZE,B> {
+    typedef OtaStage<APP,STAGE,SIZE,B> stage;
+    constexpr static int BLOCKS = SIZE / B;
+    constexpr static int TIMEOUT = 2000;  // ms, before asking again
+    constexpr static int MAX_TRIES = 5;
+
+    enum { IDLE, QUERYING, HASHING, FETCHING, READY, FAILED };
+
+    OtaClient (L& l) : link (l), state (IDLE) {}
+
+    // ask the server for its image, and start fetching it if it's different
+    void update (uint8_t id) {
+        server = id;
+        fetched = copied = chunks = errors = 0;
+        state = QUERYING;
+        request(Ota::QUERY, 0, 0, 1);
+    }
+
+    bool busy () const { return state != IDLE && state != READY && state != FAILED; }
+
+    bool handle (uint8_t const* pkt, int len);
+    void poll ();
+
+    void request (uint8_t type, uint16_t a, uint16_t b, int n);
+    void nextBlock ();
+    bool gotBlock ();
+    int blockLen (int i) const { return size - i * B < B ? size - i * B : B; }
+
+    L& link;
+    uint8_t server, state;
+    uint8_t req [5];
+    uint8_t reqLen, tries;
+    bool due, waiting;
+    uint32_t sentAt;
+    uint32_t size, hash;        // of the image being fetched
+    uint16_t blocks, block;     // number of blocks, block being fetched
+    uint16_t pos;               // bytes of the current block received so far
+    uint32_t hashes [BLOCKS];
+    uint8_t buf [B];
+    uint16_t fetched, copied, chunks, errors;  // statistics
+};
+
+template< typename L, typename APP, typename STAGE, uint32_t SIZE, int B >
+void OtaClient<L,APP,STAGE,SIZE,B>::request (uint8_t type, uint16_t a, uint16_t b, int n) {
+    req[0] = type;
+    Ota::put16(req+1, a);
+    Ota::put16(req+3, b);
+    reqLen = n;
+    tries = 0;
+    due = true;
+    waiting = false;
+}
+
+template< typename L, typename APP, typename STAGE, uint32_t SIZE, int B >
+bool OtaClient<L,APP,STAGE,SIZE,B>::handle (uint8_t const* pkt, int len) {
+    if (len < 3 || pkt[2] < Ota::QUERY || pkt[2] > Ota::DATA)
+        return false;
+    uint8_t const* p = pkt + 2;
+    len -= 2;
+    if ((pkt[1] & 0x3F) != server || !waiting || p[0] != req[0] + 1)
+        return true;  // not the reply we're waiting for
+
+    switch (p[0]) {
+        case Ota::OFFER:
+            if (len < 11)
+                return true;
+            size = Ota::get32(p+1);
+            hash = Ota::get32(p+5);
+            if (Ota::get16(p+9) != B || size > SIZE) {
+                state = FAILED;
+                break;
+            }
+            if (Ota::hash<APP>(0, size) == hash) {
+                state = IDLE;  // already running this image
+                break;
+            }
+            stage::discard();
+            blocks = (size + B - 1) / B;
+            state = HASHING;
+            request(Ota::HASHREQ, 0, 0, 3);
+            return true;
+        case Ota::HASHES: {
+            uint16_t first = Ota::get16(p+1);
+            if (len < 4 || first != Ota::get16(req+1) || len < 4 + 4 * p[3])
+                return true;
+            for (int i = 0; i < p[3] && first + i < blocks; ++i)
+                hashes[first+i] = Ota::get32(p + 4 + 4*i);
+            if (first + p[3] < blocks)
+                request(Ota::HASHREQ, first + p[3], 0, 3);
+            else {
+                state = FETCHING;
+                block = 0;
+                waiting = due = false;
+            }
+            return true;
+        }
+        case Ota::DATA: {
+            int n = len - 5;
+            if (n <= 0 || Ota::get16(p+1) != block || Ota::get16(p+3) != pos ||
+                    pos + n > blockLen(block))
+                return true;
+            memcpy(buf + pos, p + 5, n);
+            pos += n;
+            ++chunks;
+            if (pos < blockLen(block))
+                request(Ota::GET, block, pos, 5);
+            else if (!gotBlock())
+                request(Ota::GET, block, pos = 0, 5);  // bad block, refetch
+            return true;
+        }
+    }
+    waiting = due = false;
+    return true;
+}
+
+// the current block is complete, check it and store it in the staging area
+template< typename L, typename APP, typename STAGE, uint32_t SIZE, int B >
+bool OtaClient<L,APP,STAGE,SIZE,B>::gotBlock () {
+    int n = blockLen(block);
+    if (Ota::hash(buf, n) != hashes[block]) {
+        ++errors;
+        return false;
+    }
+    if (!Ota::put<STAGE>(block * B, buf, n)) {
+        state = FAILED;
+        return true;
+    }
+    ++block;
+    waiting = due = false;
+    return true;
+}
+
+// copy the next block if it hasn't changed, else start fetching it
+template< typename L, typename APP, typename STAGE, uint32_t SIZE, int B >
+void OtaClient<L,APP,STAGE,SIZE,B>::nextBlock () {
+    if (block >= blocks) {
+        if (Ota::hash<STAGE>(0, size) == hash && stage::commit(size, hash))
+            state = READY;
+        else
+            state = FAILED;
+        return;
+    }
+    int n = blockLen(block);
+    APP::read(block * B, buf, n);
+    if (Ota::hash(buf, n) == hashes[block]) {
+        if (!Ota::put<STAGE>(block * B, buf, n))
+            state = FAILED;
+        ++block;
+        ++copied;
+        return;
+    }
+    ++fetched;
+    request(Ota::GET, block, pos = 0, 5);
+}
+
+// one step per call: copy a block, or send a (repeated) request
+template< typename L, typename APP, typename STAGE, uint32_t SIZE, int B >
+void OtaClient<L,APP,STAGE,SIZE,B>::poll () {
+    if (!busy())
+        return;
+    if (state == FETCHING && !due && !waiting) {
+        nextBlock();
+        return;
+    }
+    if (waiting && (int32_t) (ticks - sentAt) >= TIMEOUT) {
+        if (++tries >= MAX_TRIES) {
+            state = FAILED;
+            return;
+        }
+        due = true;
+    }
+    if (due && !link.busy(server) && link.send(server, req, reqLen)) {
+        due = false;
+        waiting = true;
+        sentAt = ticks;
+    }
+}
@@ -0,0 +1,105 @@
+// Block store in RAM, with the same calls as SdCard, e.g. as a small RAM
+// disk, or to test and benchmark file systems and caches on the host. The
+// counters show how often the store was accessed, multi-block calls count
+// once in "calls" and once per block in "reads" or "writes". RamFlash below
+// does the same for NOR flash.
+
+#include <string.h>
+
+template< int BLOCKS, int B =512 >
+struct RamDisk {
+    static void read512 (int n, void* p) { read(n, p); }
+    static void write512 (int n, void const* p) { write(n, p); }
+    static void read256 (int n, void* p) { read(n, p); }
+    static void write256 (int n, void const* p) { write(n, p); }
+
+    static void read (int n, void* p) {
+        ++calls;
+        get(n, p);
+    }
+
+    static void write (int n, void const* p) {
+        ++calls;
+        put(n, p);
+    }
+
+    static void readMulti (int n, void* p, int cnt) {
+        ++calls;
+        for (int i = 0; i < cnt; ++i)
+            get(n + i, (uint8_t*) p + B * i);
+    }
+
+    static void writeMulti (int n, void const* p, int cnt) {
+        ++calls;
+        for (int i = 0; i < cnt; ++i)
+            put(n + i, (uint8_t const*) p + B * i);
+    }
+
+    static void get (int n, void* p) {
+        ++reads;
+        if ((unsigned) n < BLOCKS)
+            memcpy(p, data[n], B);
+        else
+            memset(p, 0xFF, B);
+    }
+
+    static void put (int n, void const* p) {
+        ++writes;
+        if ((unsigned) n < BLOCKS)
+            memcpy(data[n], p, B);
+    }
+
+    static uint8_t data [BLOCKS][B];
+    static uint32_t calls, reads, writes;  // statistics
+};
+
+template< int BLOCKS, int B >
+uint8_t RamDisk<BLOCKS,B>::data [BLOCKS][B];
+template< int BLOCKS, int B >
+uint32_t RamDisk<BLOCKS,B>::calls;
+template< int BLOCKS, int B >
+uint32_t RamDisk<BLOCKS,B>::reads;
+template< int BLOCKS, int B >
+uint32_t RamDisk<BLOCKS,B>::writes;
+
+// NOR flash in RAM, with the same calls as SpiFlash: programming can only
+// clear bits, erase sets a 4 KB sector back to all ones. Can be used as
+// the flash underneath FlashFTL or FlashKV on the host.
+
+template< int KB >
+struct RamFlash {
+    static void wipe () { memset(data, 0xFF, sizeof data); }
+
+    static void erase (int page) {
+        ++erases;
+        uint32_t addr = (page << 8) & ~0xFFF;
+        if (addr < sizeof data)
+            memset(data + addr, 0xFF, 4096);
+    }
+
+    static void read (int offset, void* buf, int cnt) {
+        ++reads;
+        for (int i = 0; i < cnt; ++i)
+            ((uint8_t*) buf)[i] = (unsigned) (offset + i) < sizeof data ?
+                                    data[offset + i] : 0xFF;
+    }
+
+    static void write (int offset, void const* buf, int cnt) {
+        ++writes;
+        for (int i = 0; i < cnt; ++i)
+            if ((unsigned) (offset + i) < sizeof data)
+                data[offset + i] &= ((uint8_t const*) buf)[i];
+    }
+
+    static uint8_t data [KB*1024];
+    static uint32_t reads, writes, erases;  // statistics
+};
+
+template< int KB >
+uint8_t RamFlash<KB>::data [KB*1024];
+template< int KB >
+uint32_t RamFlash<KB>::reads;
+template< int KB >
+uint32_t RamFlash<KB>::writes;
+template< int KB >
+uint32_t RamFlash<KB>::erases;
@@ -0,0 +1,65 @@
+// Spectrum scanner for the RF69: sweeps the receiver across a range of
+// frequencies and reports the signal strength at each step. Only the FRF
+// bytes which change are sent, i.e. usually just one per step. Each reading
+// is a single burst of RssiValue through IrqFlags1, and after each hop the
+// readings only count once the PLL reports lock, or when "lock" ms have
+// passed without it, so settling does not depend on the SPI clock. Then "avg"
+// readings are averaged. Each row entry is 255 - average rssi value, i.e.
+// higher is stronger.
+
+template< typename R >
+struct SpectrumScanner {
+    SpectrumScanner (R& r) : radio (r) {}
+
+    // the center and step are in Hz, the sweep covers width steps
+    void init (uint32_t center, uint32_t step, int width, int avg =16,
+                int lock =2) {
+        frfStep = ((uint64_t) step << 19) / 32000000;
+        frfFirst = ((uint64_t) center << 19) / 32000000 - width/2 * frfStep;
+        count = width;
+        samples = avg;
+        wait = lock;
+        frf = ~0;
+        sweeps = 0;
+        since = ticks;
+        radio.setMode(radio.MODE_RECEIVE);
+    }
+
+    void sweep (uint8_t* row) {
+        for (int x = 0; x < count; ++x) {
+            hop(frfFirst + x * frfStep);
+
+            uint32_t t = ticks, sum = 0;
+            for (int i = 0; i < samples; ) {
+                uint8_t regs [4];  // RssiValue, DioMapping1, 2, IrqFlags1
+                radio.readRegs(radio.REG_RSSIVALUE, regs, sizeof regs);
+                if ((regs[3] & radio.IRQ1_PLLLOCK) || ticks - t > wait) {
+                    sum += regs[0];
+                    ++i;
+                }
+            }
+            row[x] = 255 - sum / samples;
+        }
+        ++sweeps;
+    }
+
+    // sweeps per second since init, times 10
+    uint32_t rate () const {
+        uint32_t ms = ticks - since;
+        return ms > 0 ? (sweeps * 10000) / ms : 0;
+    }
+
+    void hop (uint32_t f) {
+        uint8_t buf [] = { (uint8_t) (f >> 16), (uint8_t) (f >> 8), (uint8_t) f };
+        // skip the leading bytes which are unchanged, the lsb is always sent
+        int i = (f ^ frf) >> 16 ? 0 : (f ^ frf) >> 8 ? 1 : 2;
+        radio.writeRegs(radio.REG_FRFMSB + i, buf + i, 3 - i);
+        frf = f;
+    }
+
+    R& radio;
+    uint32_t frfFirst, frfStep, frf;
+    int count, samples;
+    uint32_t wait;
+    uint32_t sweeps, since;
+};